@@ -1,11 +1,24 @@
 #include <gm_metric.h>
 #include <libmetrics.h>
 #include <apr_strings.h>
+#include <apr_thread_proc.h>
+#include <apr_time.h>
 #include <fcntl.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <dirent.h>
 #include <fnmatch.h>
+#include <ctype.h>
+#include <strings.h>
+#include <math.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
 
 mmodule ibcounters_module;
 
@@ -17,6 +30,52 @@ mmodule ibcounters_module;
 #define IB_STATS_CHECK_FREQUENCY (0.5) /* in seconds */
 #endif
 
+#ifndef IB_STATS_LINK_CHECK_FREQUENCY
+#define IB_STATS_LINK_CHECK_FREQUENCY (10.0) /* in seconds */
+#endif
+
+#ifndef IB_ETHTOOL_STATS_HEADROOM
+#define IB_ETHTOOL_STATS_HEADROOM (64) /* spare slots in the ethtool statistics buffer */
+#endif
+
+#ifndef IB_DERIVED_MAX_CODE
+#define IB_DERIVED_MAX_CODE (64) /* instructions per derived metric */
+#endif
+
+#ifndef IB_DERIVED_MAX_CONSTS
+#define IB_DERIVED_MAX_CONSTS (16) /* constants per derived metric */
+#endif
+
+#ifndef IB_DERIVED_MAX_STACK
+#define IB_DERIVED_MAX_STACK (16) /* evaluation stack depth */
+#endif
+
+#define IB_DERIVED_PARAM_PREFIX "derived_"
+
+#ifndef IB_SMOOTH_EWMA_TAU
+#define IB_SMOOTH_EWMA_TAU (60.0) /* in seconds */
+#endif
+
+#ifndef IB_SMOOTH_SLOT_PERIOD
+#define IB_SMOOTH_SLOT_PERIOD (5.0) /* in seconds */
+#endif
+
+#ifndef IB_SMOOTH_SLOT_COUNT
+#define IB_SMOOTH_SLOT_COUNT (192) /* must exceed the longest window in slot periods */
+#endif
+
+#ifndef IB_ALERT_MAX_CHILDREN
+#define IB_ALERT_MAX_CHILDREN (8) /* outstanding gmetric processes */
+#endif
+
+#ifndef IB_ALERT_MIN_INTERVAL
+#define IB_ALERT_MIN_INTERVAL (IB_STATS_CHECK_FREQUENCY / 10.0) /* in seconds */
+#endif
+
+#ifndef IB_ALERT_SAMPLE_COUNT
+#define IB_ALERT_SAMPLE_COUNT (32) /* samples retained per watched counter */
+#endif
+
 /*!
     @enumerate InfiniBand counter indexes
     
@@ -251,6 +310,186 @@ static IBMetricDescriptor* IBMetricDescriptors[kIBDriverMax] = {
         IBMetricDescriptors_mlx5
     };
 
+/*!
+    @enumerate InfiniBand link field indexes
+    
+    Enumerates the link-state fields that are tracked for each
+    device-port, with the final value (kIBMaxLinkFieldIdx) representing
+    the number of fields present.
+*/
+enum {
+    kIBLinkStateFieldIdx = 0,
+    kIBLinkPhysStateFieldIdx,
+
+    kIBMaxLinkFieldIdx
+};
+
+/*!
+    @enumerate InfiniBand logical port states
+    
+    The numeric prefix of the value read from ports/<port#>/state, e.g.
+    "4: ACTIVE".  Only an active port has counters worth reading.
+*/
+enum {
+    kIBPortStateDown = 1,
+    kIBPortStateInit,
+    kIBPortStateArmed,
+    kIBPortStateActive
+};
+
+/*!
+    @constant IBLinkMetricDescriptors
+    
+    Metric descriptors for the link-state fields.  The sysfs files are
+    the same for all drivers.  Values like "4: ACTIVE" and "5: LinkUp"
+    read as their leading numeric code.
+*/
+static IBMetricDescriptor IBLinkMetricDescriptors[kIBMaxLinkFieldIdx] = {
+        {
+            "state",
+            {0, "%s_p%ld_LinkState",        0, GANGLIA_VALUE_DOUBLE, "",        "both", "%.0f", UDP_HEADER_SIZE+16, "Logical link state (1=down, 2=init, 3=armed, 4=active)"},
+            kIBCounterTypeCount
+        },
+        {
+            "phys_state",
+            {0, "%s_p%ld_LinkPhysState",    0, GANGLIA_VALUE_DOUBLE, "",        "both", "%.0f", UDP_HEADER_SIZE+16, "Physical link state (2=polling, 3=disabled, 5=linkup)"},
+            kIBCounterTypeCount
+        }
+    };
+
+/*!
+    @constant IBDevicePortMetricCount
+    
+    The number of Ganglia metrics registered for every device-port:  the
+    counters followed by the link-state fields.  Ports with an Ethernet
+    link layer register additional RoCE metrics after these.
+*/
+#define IBDevicePortMetricCount (kIBMaxCounterIdx + kIBMaxLinkFieldIdx)
+
+/*!
+    @enumerate RoCE netdev statistics indexes
+    
+    Enumerates the /sys/class/net/<if>/statistics counters that are
+    tracked for device-ports with an Ethernet link layer, with the final
+    value (kIBMaxNetDevStatIdx) representing the number of counters
+    present.
+*/
+enum {
+    kIBNetDevTxBytesStatIdx = 0,
+    kIBNetDevTxPktStatIdx,
+    kIBNetDevTxErrStatIdx,
+    kIBNetDevTxDroppedStatIdx,
+
+    kIBNetDevRxBytesStatIdx,
+    kIBNetDevRxPktStatIdx,
+    kIBNetDevRxErrStatIdx,
+    kIBNetDevRxDroppedStatIdx,
+    kIBNetDevRxMulticastStatIdx,
+
+    kIBMaxNetDevStatIdx
+};
+
+/*!
+    @constant IBNetDevMetricDescriptors
+    
+    Metric descriptors for the netdev statistics of RoCE device-ports.
+    The subpath is relative to the netdev's statistics/ directory; the
+    per-port copy of each descriptor is rewritten to be relative to the
+    device-port directory.
+*/
+static IBMetricDescriptor IBNetDevMetricDescriptors[kIBMaxNetDevStatIdx] = {
+        {
+            "tx_bytes",
+            {0, "%s_p%ld_NetTxBytes",       0, GANGLIA_VALUE_DOUBLE, "bytes/s", "both", "%.3f", UDP_HEADER_SIZE+16, "Ethernet bytes transmitted (in bytes per second)"},
+            kIBCounterTypeRate
+        },
+        {
+            "tx_packets",
+            {0, "%s_p%ld_NetTxPkt",         0, GANGLIA_VALUE_DOUBLE, "pkt/s",   "both", "%.3f", UDP_HEADER_SIZE+16, "Ethernet packets transmitted (in packets per second)"},
+            kIBCounterTypeRate
+        },
+        {
+            "tx_errors",
+            {0, "%s_p%ld_NetTxErrs",        0, GANGLIA_VALUE_DOUBLE, "",        "both", "%.0f", UDP_HEADER_SIZE+16, "Ethernet transmit error count"},
+            kIBCounterTypeCount
+        },
+        {
+            "tx_dropped",
+            {0, "%s_p%ld_NetTxDropped",     0, GANGLIA_VALUE_DOUBLE, "",        "both", "%.0f", UDP_HEADER_SIZE+16, "Ethernet dropped transmit count"},
+            kIBCounterTypeCount
+        },
+    
+        {
+            "rx_bytes",
+            {0, "%s_p%ld_NetRxBytes",       0, GANGLIA_VALUE_DOUBLE, "bytes/s", "both", "%.3f", UDP_HEADER_SIZE+16, "Ethernet bytes received (in bytes per second)"},
+            kIBCounterTypeRate
+        },
+        {
+            "rx_packets",
+            {0, "%s_p%ld_NetRxPkt",         0, GANGLIA_VALUE_DOUBLE, "pkt/s",   "both", "%.3f", UDP_HEADER_SIZE+16, "Ethernet packets received (in packets per second)"},
+            kIBCounterTypeRate
+        },
+        {
+            "rx_errors",
+            {0, "%s_p%ld_NetRxErrs",        0, GANGLIA_VALUE_DOUBLE, "",        "both", "%.0f", UDP_HEADER_SIZE+16, "Ethernet receive error count"},
+            kIBCounterTypeCount
+        },
+        {
+            "rx_dropped",
+            {0, "%s_p%ld_NetRxDropped",     0, GANGLIA_VALUE_DOUBLE, "",        "both", "%.0f", UDP_HEADER_SIZE+16, "Ethernet dropped receive count"},
+            kIBCounterTypeCount
+        },
+        {
+            "multicast",
+            {0, "%s_p%ld_NetRxMulticast",   0, GANGLIA_VALUE_DOUBLE, "pkt/s",   "both", "%.3f", UDP_HEADER_SIZE+16, "Ethernet multicast packets received (in packets per second)"},
+            kIBCounterTypeRate
+        }
+    };
+
+/*!
+    @constant IBEthtoolMetricPatterns
+    
+    Metric descriptor templates for the ethtool statistics of RoCE
+    device-ports.  The subpath is a fnmatch() pattern selecting ethtool
+    statistic names; each statistic matched produces a metric named
+    <device>_p<port#>_<statistic name> using the remainder of the
+    template.
+    
+    The mlx5 and mlx4 drivers name the per-priority statistics differently
+    (rx_prio0_pause vs. rx_pause_prio_0, rx_prio0_bytes vs. rx_prio_0_bytes),
+    so both forms are listed.  rx_discards_phy is mlx5-only.
+*/
+static IBMetricDescriptor IBEthtoolMetricPatterns[] = {
+        {
+            "[rt]x_prio[0-7]_pause",
+            {0, NULL,                       0, GANGLIA_VALUE_DOUBLE, "frame/s", "both", "%.3f", UDP_HEADER_SIZE+16, "Per-priority PFC pause frames (in frames per second)"},
+            kIBCounterTypeRate
+        },
+        {
+            "[rt]x_pause_prio_[0-7]",
+            {0, NULL,                       0, GANGLIA_VALUE_DOUBLE, "frame/s", "both", "%.3f", UDP_HEADER_SIZE+16, "Per-priority PFC pause frames (in frames per second)"},
+            kIBCounterTypeRate
+        },
+        {
+            "[rt]x_prio[0-7]_bytes",
+            {0, NULL,                       0, GANGLIA_VALUE_DOUBLE, "bytes/s", "both", "%.3f", UDP_HEADER_SIZE+16, "Per-priority bytes (in bytes per second)"},
+            kIBCounterTypeRate
+        },
+        {
+            "[rt]x_prio_[0-7]_bytes",
+            {0, NULL,                       0, GANGLIA_VALUE_DOUBLE, "bytes/s", "both", "%.3f", UDP_HEADER_SIZE+16, "Per-priority bytes (in bytes per second)"},
+            kIBCounterTypeRate
+        },
+        {
+            "rx_discards_phy",
+            {0, NULL,                       0, GANGLIA_VALUE_DOUBLE, "",        "both", "%.0f", UDP_HEADER_SIZE+16, "Packets discarded by the physical port count"},
+            kIBCounterTypeCount
+        },
+        {
+            NULL
+        }
+    };
+
 /*!
     @enumerate Tri-state of a read counter
     
@@ -294,12 +533,241 @@ typedef struct {
     struct timeval  lastReadTime;
 } IBCounterField;
 
+/*!
+    @typedef IBRoCEField
+    
+    A RoCE counter field pairs a per-port metric descriptor (whose subpath
+    and metric name are owned by the field) with its counter state.  Fields
+    backed by a netdev statistics file have an ethtoolStatIdx of
+    kIBRoCENetDevStatIdx; all others take their value from that index in
+    the port's ethtool statistics buffer, or have kIBRoCEMissingStatIdx if
+    the statistic is no longer reported by the driver.
+*/
+enum {
+    kIBRoCENetDevStatIdx = -1,
+    kIBRoCEMissingStatIdx = -2
+};
+
+typedef struct {
+    IBMetricDescriptor  descriptor;
+    int                 ethtoolStatIdx;
+    IBCounterField      field;
+} IBRoCEField;
+
+/*!
+    @enumerate Derived-metric bytecode operations
+    
+    Operations of the stack machine that evaluates derived metrics.  The
+    const and load operations push a value; the arithmetic operations
+    pop their operands and push the result.
+    
+    - const:    push consts[operand]
+    - value:    push the reported value (count or rate) of field operand
+    - raw:      push the last-read raw counter value of field operand
+*/
+enum {
+    kIBDerivedOpConst = 0,
+    kIBDerivedOpLoadValue,
+    kIBDerivedOpLoadRaw,
+    kIBDerivedOpAdd,
+    kIBDerivedOpSub,
+    kIBDerivedOpMul,
+    kIBDerivedOpDiv,
+    kIBDerivedOpNeg
+};
+
+/*!
+    @typedef IBDerivedInstr
+    
+    A single bytecode instruction:  the operation and, for const and load
+    operations, its operand.  Field operands are per-port metric indexes
+    as understood by IBDevicePortGetField().
+*/
+typedef struct {
+    unsigned char       opcode;
+    unsigned char       operand;
+} IBDerivedInstr;
+
+/*!
+    @typedef IBDerivedMetric
+    
+    A derived metric declared in the module configuration.  The descriptor
+    acts as the metric template for every device-port (its subpath holds
+    the source expression); the expression itself is compiled once into
+    the fixed-size code and consts arrays so that evaluation never needs
+    to allocate.
+*/
+typedef struct {
+    IBMetricDescriptor  descriptor;
+    int                 codeLen;
+    IBDerivedInstr      code[IB_DERIVED_MAX_CODE];
+    int                 constCount;
+    double              consts[IB_DERIVED_MAX_CONSTS];
+} IBDerivedMetric;
+
+/*!
+    @constant IBDerivedMetrics
+    
+    Array of the derived metrics compiled by IBDerivedMetricsInit().
+*/
+static IBDerivedMetric  *IBDerivedMetrics = NULL;
+
+/*!
+    @constant IBDerivedMetricsCount
+    
+    The number of elements in the IBDerivedMetrics array.
+*/
+static int              IBDerivedMetricsCount = 0;
+
+/*!
+    @enumerate Smoothed rate kinds
+    
+    Enumerates the smoothed variants that can be reported for each
+    rate-based counter, with the final value (kIBMaxSmoothIdx)
+    representing the number of variants present.
+*/
+enum {
+    kIBSmoothEwmaIdx = 0,
+    kIBSmooth1MinIdx,
+    kIBSmooth5MinIdx,
+    kIBSmooth15MinIdx,
+
+    kIBMaxSmoothIdx
+};
+
+/*!
+    @constant IBSmoothKinds
+    
+    For each smoothed rate kind, the name used to select it in the module
+    configuration (and appended to the counter's metric name), the
+    averaging window in seconds (zero for the EWMA), and a description
+    suffix.
+    
+    Ordered to match the smoothed rate kind enumeration.
+*/
+static const struct {
+    const char  *name;
+    double      window;
+    const char  *description;
+} IBSmoothKinds[kIBMaxSmoothIdx] = {
+        { "ewma",   0.0,    "exponentially-weighted moving average" },
+        { "1m",     60.0,   "1-minute average" },
+        { "5m",     300.0,  "5-minute average" },
+        { "15m",    900.0,  "15-minute average" }
+    };
+
+/*!
+    @typedef IBRateHistory
+    
+    Constant-size history of a rate-based counter used to produce its
+    smoothed rates.  The ring holds snapshots of the raw counter value
+    taken at most once per IB_SMOOTH_SLOT_PERIOD.  A windowed average is the
+    difference between the latest value and the counter value at the start
+    of the window -- interpolated between the two snapshots that bracket
+    it -- over the window length.  Since window starts only move forward,
+    each window keeps the age of the youngest snapshot at or before its
+    start (slotCount when there is none) and advances it toward the newest
+    snapshot, so each sample costs amortized constant work.
+*/
+typedef struct {
+    int             slotCount, slotHead;
+    double          slotValue[IB_SMOOTH_SLOT_COUNT];
+    double          slotTime[IB_SMOOTH_SLOT_COUNT];
+    int             windowSlotAge[kIBMaxSmoothIdx];
+    double          nextSlotTime;
+    double          lastSampleTime;
+    double          ewma;
+} IBRateHistory;
+
+/*!
+    @typedef IBSmoothedMetric
+    
+    A smoothed rate metric enabled in the module configuration:  the
+    counter and smoothing kind it reports, and the metric template used
+    for every device-port.
+*/
+typedef struct {
+    int                 counterIdx;
+    int                 smoothIdx;
+    IBMetricDescriptor  descriptor;
+} IBSmoothedMetric;
+
+/*!
+    @constant IBSmoothedMetrics
+    
+    Array of the smoothed rate metrics enabled by IBSmoothedMetricsInit().
+*/
+static IBSmoothedMetric *IBSmoothedMetrics = NULL;
+
+/*!
+    @constant IBSmoothedMetricsCount
+    
+    The number of elements in the IBSmoothedMetrics array.
+*/
+static int              IBSmoothedMetricsCount = 0;
+
+/*!
+    @constant IBSmoothEwmaTau
+    
+    Time constant (in seconds) of the exponentially-weighted moving
+    averages.
+*/
+static double           IBSmoothEwmaTau = IB_SMOOTH_EWMA_TAU;
+
+/*!
+    @typedef IBErrorWatchSample
+    
+    A counter value read by the error watcher and the time it was read.
+*/
+typedef struct {
+    double          time;
+    double          value;
+} IBErrorWatchSample;
+
+/*!
+    @typedef IBErrorWatchField
+    
+    State the error watcher keeps for one error counter of a device-port:
+    the descriptor of the counter's sysfs file, held open between reads,
+    and a ring of recent samples against which increments are measured.
+    The ring holds sampleCount samples in time order, the newest at
+    sampleHead.  Samples are retained no more often than once every
+    1/(IB_ALERT_SAMPLE_COUNT - 1) of the alert window, so the ring always
+    spans the whole window.
+*/
+typedef struct {
+    int                 fd;
+    int                 sampleHead, sampleCount;
+    IBErrorWatchSample  samples[IB_ALERT_SAMPLE_COUNT];
+    double              lastAlertTime;
+} IBErrorWatchField;
+
 /*!
     @typedef IBDevicePort
     
     Linked-list element that wraps a recognized InfiniBand device-port
     with its driver's metric descriptor templates and the set of counter
     fields' state records.
+    
+    The link-state fields are refreshed on a slower cadence than the
+    counters; isLinkActive caches whether the last known logical state
+    permits counter reads.
+    
+    Device-ports with an Ethernet link layer are mapped to a netdev at
+    init and carry an additional array of RoCE counter fields, along with
+    a preallocated buffer for the ethtool statistics of that netdev.
+    
+    The derivedFields array holds one field per element of IBDerivedMetrics
+    and is allocated along with the IBDevicePort itself.
+    
+    Each counter has a field for every smoothed rate kind and, when smoothed
+    metrics are enabled, each rate-based counter has a rate history
+    allocated along with the IBDevicePort itself (NULL for the others).
+    
+    The errorWatch array and the errorWatch* link-state fields are owned by
+    the error watcher thread, which uses only the entries of count-type
+    counters and tracks the logical link state itself through its own
+    descriptor of the port's state file.
 */
 typedef struct __IBDevicePort {
     /* Link to next record: */
@@ -314,6 +782,32 @@ typedef struct __IBDevicePort {
     
     /* Counter fields: */
     IBCounterField          fields[kIBMaxCounterIdx];
+    
+    /* Link-state fields: */
+    IBCounterField          linkFields[kIBMaxLinkFieldIdx];
+    int                     isLinkActive;
+    
+    /* RoCE fields: */
+    char                    netDevName[IFNAMSIZ];
+    int                     roceFieldCount;
+    IBRoCEField             *roceFields;
+    struct ethtool_stats    *ethtoolStats;
+    int                     ethtoolStatCount;
+    int                     ethtoolStatCapacity;
+    struct timeval          ethtoolReadTime;
+    
+    /* Derived fields: */
+    IBCounterField          *derivedFields;
+    
+    /* Smoothed rate fields: */
+    IBRateHistory           *rateHistory[kIBMaxCounterIdx];
+    IBCounterField          smoothFields[kIBMaxCounterIdx][kIBMaxSmoothIdx];
+    
+    /* Error watcher state: */
+    IBErrorWatchField       errorWatch[kIBMaxCounterIdx];
+    int                     errorWatchStateFd;
+    int                     errorWatchLinkActive;
+    double                  errorWatchStateTime;
 } IBDevicePort;
 
 /*!
@@ -326,7 +820,10 @@ typedef struct __IBDevicePort {
     fields.
     
     The entire data structure is zeroed, which leaves the counter fields
-    in an appropriately-initialized state.
+    in an appropriately-initialized state.  Storage for the derived fields,
+    the rate histories (if smoothing is enabled) and the device name follows
+    the IBDevicePort in the same allocation, so IBDerivedMetricsInit() and
+    IBSmoothedMetricsInit() must have been called beforehand.
     
     In case of any error, NULL is retured.  Otherwise, a pointer to
     the allocated and initialized IBDevicePort element is returned.
@@ -346,13 +843,30 @@ IBDevicePortAlloc(
         driverIdx++;
     }
     if ( driverIdx < kIBDriverMax ) {
-        size_t      newDevicePortSize = sizeof(IBDevicePort) + strlen(devName) + 1;
+        size_t      derivedFieldsSize = IBDerivedMetricsCount * sizeof(IBCounterField);
+        size_t      rateHistorySize = 0;
+        size_t      newDevicePortSize;
+        int         counterIdx = 0;
+        
+        while ( (IBSmoothedMetricsCount > 0) && (counterIdx < kIBMaxCounterIdx) ) {
+            if ( IBMetricDescriptors[driverIdx][counterIdx].counterType == kIBCounterTypeRate ) rateHistorySize += sizeof(IBRateHistory);
+            counterIdx++;
+        }
+        newDevicePortSize = sizeof(IBDevicePort) + derivedFieldsSize + rateHistorySize + strlen(devName) + 1;
         
         newDevicePort = (IBDevicePort*)malloc(newDevicePortSize);
         if ( newDevicePort ) {
+            IBRateHistory   *rateHistory = ((void*)newDevicePort) + sizeof(IBDevicePort) + derivedFieldsSize;
+            
             memset(newDevicePort, 0, newDevicePortSize);
         
-            newDevicePort->devName = ((void*)newDevicePort) + sizeof(IBDevicePort);
+            newDevicePort->derivedFields = ((void*)newDevicePort) + sizeof(IBDevicePort);
+            counterIdx = 0;
+            while ( rateHistorySize && (counterIdx < kIBMaxCounterIdx) ) {
+                if ( IBMetricDescriptors[driverIdx][counterIdx].counterType == kIBCounterTypeRate ) newDevicePort->rateHistory[counterIdx] = rateHistory++;
+                counterIdx++;
+            }
+            newDevicePort->devName = ((void*)newDevicePort) + sizeof(IBDevicePort) + derivedFieldsSize + rateHistorySize;
             strcpy((char*)newDevicePort->devName, devName);
         
             newDevicePort->devPort = devPort;
@@ -394,104 +908,1408 @@ __IBDevicePortReadCounter(
 }
 
 /*!
-    @function IBDevicePortReadCounters
-    
-    Attempt to read all counters associated with a device-port.  Each field's
-    state is progressed independently, so failure to read one counter does not
-    prevent the reporting of others.
+    @function __IBTimeIntervalSince
     
-    On exit, any field associated with devToRead in state kIBFieldStateValued
-    can be reported to gmond.
+    Returns the number of seconds elapsed from lastTime to currentTime.
+ */
+static double
+__IBTimeIntervalSince(
+    struct timeval  *currentTime,
+    struct timeval  *lastTime
+)
+{
+    return ((double)currentTime->tv_sec * 1.0e6 +
+                (double)currentTime->tv_usec -
+                (double)lastTime->tv_sec * 1.0e6 -
+                (double)lastTime->tv_usec) * 1.0e-6;
+}
+
+/*!
+    @function __IBCounterFieldUpdate
     
-    The compile-time constant IB_STATS_CHECK_FREQUENCY determines how often a
-    counter will be rechecked, regardless of the granularity configured in
-    gmond.
+    Progress the state of a single counter field given the outcome of an
+    attempt to read its value at currentTime.  If didRead is zero the
+    value is ignored and the field falls back to the unknown state.
  */
 static void
-IBDevicePortReadCounters(
-    IBDevicePort        *devToRead
+__IBCounterFieldUpdate(
+    IBCounterField  *field,
+    int             counterType,
+    int             didRead,
+    double          value,
+    struct timeval  *currentTime
 )
 {
-    int                 rc = 0;
-    struct timeval      currentTime;
-    int                 counterIdx = 0;
+    if ( ! didRead ) {
+        /* Failed to read the counter, so fall back to unknown state: */
+        field->fieldState = kIBFieldStateUnknown;
+        return;
+    }
     
-    while ( counterIdx < kIBMaxCounterIdx ) {
-        gettimeofday(&currentTime, NULL);
-        
-        /* What do we need to do? */
-        switch ( devToRead->fields[counterIdx].fieldState ) {
-        
-            case kIBFieldStateUnknown: {
-                double      value;
-                
-                /* Force a read: */
-                if ( __IBDevicePortReadCounter(devToRead, devToRead->metricDescriptors[counterIdx].subpath, &value) ) {
-                    devToRead->fields[counterIdx].lastReadValue = value;
-                    devToRead->fields[counterIdx].currentValue = value;
-                    devToRead->fields[counterIdx].lastReadTime = currentTime;
-                    /* If this is a simple counter, we can transition right to "value" state: */
-                    if ( devToRead->metricDescriptors[counterIdx].counterType == kIBCounterTypeCount ) {
-                        devToRead->fields[counterIdx].fieldState = kIBFieldStateValued;
-                    } else {
-                        devToRead->fields[counterIdx].fieldState = kIBFieldStateInited;
-                    }
-                }
-                break;
+    /* What do we need to do? */
+    switch ( field->fieldState ) {
+    
+        case kIBFieldStateUnknown: {
+            field->lastReadValue = value;
+            field->currentValue = value;
+            field->lastReadTime = *currentTime;
+            /* If this is a simple counter, we can transition right to "value" state: */
+            if ( counterType == kIBCounterTypeCount ) {
+                field->fieldState = kIBFieldStateValued;
+            } else {
+                field->fieldState = kIBFieldStateInited;
             }
-            
-            case kIBFieldStateInited:
-            case kIBFieldStateValued: {
-                double      dt = ((double)currentTime.tv_sec * 1.0e6 +
-                                      (double)currentTime.tv_usec -
-                                      (double)devToRead->fields[counterIdx].lastReadTime.tv_sec * 1.0e6 -
-                                      (double)devToRead->fields[counterIdx].lastReadTime.tv_usec) * 1.0e-6;
-            
-                if ( dt >= IB_STATS_CHECK_FREQUENCY ) {
-                    double  value;
-                
-                    /* Force a read: */
-                    if ( __IBDevicePortReadCounter(devToRead, devToRead->metricDescriptors[counterIdx].subpath, &value) ) {
-                        switch ( devToRead->metricDescriptors[counterIdx].counterType ) {
-                            case kIBCounterTypeCount:
-                                devToRead->fields[counterIdx].currentValue = value;
-                                break;
-                            case kIBCounterTypeRate:
-                                devToRead->fields[counterIdx].currentValue = ( value - devToRead->fields[counterIdx].lastReadValue ) / dt;
-                                break;
-                        }
-                        devToRead->fields[counterIdx].lastReadValue = value;
-                        devToRead->fields[counterIdx].lastReadTime = currentTime;
-                        devToRead->fields[counterIdx].fieldState = kIBFieldStateValued;
-                    } else {
-                        /* Failed to read the counter, so fall back to unknown state: */
-                        devToRead->fields[counterIdx].fieldState = kIBFieldStateUnknown;
-                    }
-                }
+            break;
+        }
+        
+        case kIBFieldStateInited:
+        case kIBFieldStateValued: {
+            switch ( counterType ) {
+                case kIBCounterTypeCount:
+                    field->currentValue = value;
+                    break;
+                case kIBCounterTypeRate:
+                    field->currentValue = ( value - field->lastReadValue ) / __IBTimeIntervalSince(currentTime, &field->lastReadTime);
+                    break;
             }
+            field->lastReadValue = value;
+            field->lastReadTime = *currentTime;
+            field->fieldState = kIBFieldStateValued;
+            break;
         }
-        counterIdx++;
     }
 }
 
 /*!
-    @constant IBDevicePortsHead
-    
-    Head of the device-port linked list created by this module.
-*/
-static IBDevicePort *IBDevicePortsHead = NULL;
-
-/*!
-    @constant IBDevicePortsCount
+    @function __IBDevicePortRefreshField
     
-    The number of device-port elements present in the IBDevicePortsHead linked list.
-*/
-static int          IBDevicePortsCount = 0;
-
-/*!
-    @function IBDevicePortsInit
+    Progress the state of a single field associated with a device-port,
+    reading the descriptor's file if the field is in the unknown state
+    or at least checkFrequency seconds have elapsed since its last read.
     
-    Determine how many IB ports are present and allocate state storage for each.
+    Returns non-zero if a new value was read into the field, zero otherwise.
+ */
+static int
+__IBDevicePortRefreshField(
+    IBDevicePort        *devToRead,
+    IBMetricDescriptor  *descriptor,
+    IBCounterField      *field,
+    double              checkFrequency
+)
+{
+    struct timeval      currentTime;
+    
+    gettimeofday(&currentTime, NULL);
+    
+    if ( (field->fieldState == kIBFieldStateUnknown) || (__IBTimeIntervalSince(&currentTime, &field->lastReadTime) >= checkFrequency) ) {
+        double          value;
+        int             didRead = __IBDevicePortReadCounter(devToRead, descriptor->subpath, &value);
+        
+        __IBCounterFieldUpdate(field, descriptor->counterType, didRead, value, &currentTime);
+        return didRead;
+    }
+    return 0;
+}
+
+/*!
+    @function __IBRateHistoryReset
+    
+    Discard a rate history and invalidate the smoothed fields it feeds.
+ */
+static void
+__IBRateHistoryReset(
+    IBRateHistory   *history,
+    IBCounterField  *smoothFields
+)
+{
+    int             smoothIdx = 0;
+    
+    history->slotCount = 0;
+    while ( smoothIdx < kIBMaxSmoothIdx ) {
+        smoothFields[smoothIdx].fieldState = kIBFieldStateUnknown;
+        smoothIdx++;
+    }
+}
+
+/*!
+    @function __IBRateHistoryUpdate
+    
+    Fold the sample just read into a rate-based counter field into its
+    history and recompute the smoothed fields, using the field's own
+    read timestamp.
+    
+    A field that has only been inited, or a counter that went backwards,
+    (re)starts the history from the sample.  Windowed averages are reported
+    over whatever history exists until the window has filled.
+    
+    The ring is ordered by age (0 being the newest snapshot) with times
+    decreasing as age increases; the current sample acts as a snapshot
+    newer than all of them when bracketing the start of a window.
+ */
+static void
+__IBRateHistoryUpdate(
+    IBRateHistory   *history,
+    IBCounterField  *field,
+    IBCounterField  *smoothFields
+)
+{
+    double          t = (double)field->lastReadTime.tv_sec + 1.0e-6 * (double)field->lastReadTime.tv_usec;
+    double          v = field->lastReadValue;
+    int             smoothIdx;
+    
+    if ( (field->fieldState != kIBFieldStateValued) || (history->slotCount == 0) || (v < history->slotValue[history->slotHead]) ) {
+        __IBRateHistoryReset(history, smoothFields);
+        history->slotCount = 1;
+        history->slotHead = 0;
+        history->slotValue[0] = v;
+        history->slotTime[0] = t;
+        for ( smoothIdx = 0; smoothIdx < kIBMaxSmoothIdx; smoothIdx++ ) history->windowSlotAge[smoothIdx] = 1;
+        history->nextSlotTime = t + IB_SMOOTH_SLOT_PERIOD;
+        history->lastSampleTime = t;
+        return;
+    }
+    
+    /* Exponentially-weighted moving average, weighted by the sample interval: */
+    if ( smoothFields[kIBSmoothEwmaIdx].fieldState != kIBFieldStateValued ) {
+        history->ewma = field->currentValue;
+    } else {
+        history->ewma += (1.0 - exp(-(t - history->lastSampleTime) / IBSmoothEwmaTau)) * (field->currentValue - history->ewma);
+    }
+    history->lastSampleTime = t;
+    smoothFields[kIBSmoothEwmaIdx].currentValue = history->ewma;
+    smoothFields[kIBSmoothEwmaIdx].fieldState = kIBFieldStateValued;
+    
+    /* Snapshot the counter once per slot period: */
+    if ( t >= history->nextSlotTime ) {
+        history->slotHead = (history->slotHead + 1) % IB_SMOOTH_SLOT_COUNT;
+        history->slotValue[history->slotHead] = v;
+        history->slotTime[history->slotHead] = t;
+        if ( history->slotCount < IB_SMOOTH_SLOT_COUNT ) history->slotCount++;
+        for ( smoothIdx = 0; smoothIdx < kIBMaxSmoothIdx; smoothIdx++ ) {
+            /* Every snapshot aged by one; the oldest may have been overwritten: */
+            if ( ++history->windowSlotAge[smoothIdx] > history->slotCount ) history->windowSlotAge[smoothIdx] = history->slotCount;
+        }
+        history->nextSlotTime += IB_SMOOTH_SLOT_PERIOD * (floor((t - history->nextSlotTime) / IB_SMOOTH_SLOT_PERIOD) + 1.0);
+    }
+    
+    /* Windowed averages against the counter value at the start of each window: */
+    for ( smoothIdx = kIBSmooth1MinIdx; smoothIdx < kIBMaxSmoothIdx; smoothIdx++ ) {
+        double      windowStart = t - IBSmoothKinds[smoothIdx].window;
+        double      startTime, startValue;
+        int         lo = history->windowSlotAge[smoothIdx], oldSlot;
+        
+        /* Advance to the youngest snapshot at or before windowStart: */
+        while ( (lo > 0) && (history->slotTime[(history->slotHead - (lo - 1) + IB_SMOOTH_SLOT_COUNT) % IB_SMOOTH_SLOT_COUNT] <= windowStart) ) lo--;
+        history->windowSlotAge[smoothIdx] = lo;
+        if ( lo == history->slotCount ) {
+            /* Window not yet filled, so average over the whole history: */
+            oldSlot = (history->slotHead - (history->slotCount - 1) + IB_SMOOTH_SLOT_COUNT) % IB_SMOOTH_SLOT_COUNT;
+            startTime = history->slotTime[oldSlot];
+            startValue = history->slotValue[oldSlot];
+        } else {
+            double  newTime = t, newValue = v;
+            
+            oldSlot = (history->slotHead - lo + IB_SMOOTH_SLOT_COUNT) % IB_SMOOTH_SLOT_COUNT;
+            if ( lo > 0 ) {
+                int newSlot = (oldSlot + 1) % IB_SMOOTH_SLOT_COUNT;
+                
+                newTime = history->slotTime[newSlot];
+                newValue = history->slotValue[newSlot];
+            }
+            startTime = windowStart;
+            startValue = history->slotValue[oldSlot];
+            if ( newTime > history->slotTime[oldSlot] ) {
+                startValue += (newValue - startValue) * (windowStart - history->slotTime[oldSlot]) / (newTime - history->slotTime[oldSlot]);
+            }
+        }
+        if ( startTime < t ) {
+            smoothFields[smoothIdx].currentValue = (v - startValue) / (t - startTime);
+            smoothFields[smoothIdx].fieldState = kIBFieldStateValued;
+        }
+    }
+}
+
+/*!
+    @constant IBEthtoolSocket
+    
+    Socket used to issue ethtool ioctls against the netdevs of RoCE
+    device-ports.  Opened on demand by IBDevicePortRoCEInit().
+*/
+static int          IBEthtoolSocket = -1;
+
+/*!
+    @function __IBEthtoolIoctl
+    
+    Issue the ethtool command cmdData against the named netdev.
+    
+    Returns non-zero if the ioctl succeeded, zero otherwise.
+ */
+static int
+__IBEthtoolIoctl(
+    const char      *netDevName,
+    void            *cmdData
+)
+{
+    struct ifreq    ifr;
+    
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", netDevName);
+    ifr.ifr_data = cmdData;
+    return ( ioctl(IBEthtoolSocket, SIOCETHTOOL, &ifr) == 0 );
+}
+
+/*!
+    @function __IBEthtoolStatCount
+    
+    Returns the number of ethtool statistics the named netdev reports, or
+    zero if they cannot be determined.
+ */
+static int
+__IBEthtoolStatCount(
+    const char                  *netDevName
+)
+{
+    union {
+        struct ethtool_sset_info    info;
+        __u64                       buffer[(sizeof(struct ethtool_sset_info) + sizeof(__u32) + sizeof(__u64) - 1) / sizeof(__u64)];
+    }                           ssetInfo;
+    struct ethtool_drvinfo      drvInfo;
+    
+    memset(&ssetInfo, 0, sizeof(ssetInfo));
+    ssetInfo.info.cmd = ETHTOOL_GSSET_INFO;
+    ssetInfo.info.sset_mask = 1ULL << ETH_SS_STATS;
+    if ( __IBEthtoolIoctl(netDevName, &ssetInfo) && (ssetInfo.info.sset_mask & (1ULL << ETH_SS_STATS)) ) return ssetInfo.info.data[0];
+    
+    /* Older kernels only report the count with the driver info: */
+    memset(&drvInfo, 0, sizeof(drvInfo));
+    drvInfo.cmd = ETHTOOL_GDRVINFO;
+    if ( __IBEthtoolIoctl(netDevName, &drvInfo) ) return drvInfo.n_stats;
+    return 0;
+}
+
+/*!
+    @function __IBDevicePortReadString
+    
+    Construct the path to the device-port's file (at subpath) and read the first
+    line of it into buffer, sans trailing newline.
+    
+    Returns non-zero if the file was read, zero otherwise.
+ */
+static int
+__IBDevicePortReadString(
+    IBDevicePort    *devToRead,
+    const char      *subpath,
+    char            *buffer,
+    size_t          bufferLen
+)
+{
+    FILE            *fptr;
+    int             rc = 0;
+    char            path[PATH_MAX];
+
+    if ( snprintf(path, sizeof(path), IB_STATS_BASE_DIR "/%s/ports/%ld/%s", devToRead->devName, devToRead->devPort, subpath) < sizeof(path) ) {
+        if ( (fptr = fopen(path, "r")) ) {
+            if ( fgets(buffer, bufferLen, fptr) ) {
+                buffer[strcspn(buffer, "\n")] = '\0';
+                rc = 1;
+            }
+            fclose(fptr);
+        }
+    }
+    return rc;
+}
+
+/*!
+    @function __IBDevicePortFindNetDev
+    
+    Locate the netdev associated with a device-port by walking the
+    /sys/class/infiniband/<devName>/device/net directory.  A netdev whose
+    dev_port matches the (zero-based) device-port is preferred; failing
+    that, the first netdev present is used.
+    
+    On success the name is copied to devToRead->netDevName and non-zero
+    is returned.
+ */
+static int
+__IBDevicePortFindNetDev(
+    IBDevicePort    *devToRead
+)
+{
+    DIR             *dptr;
+    char            path[PATH_MAX];
+    int             rc = 0;
+    
+    if ( snprintf(path, sizeof(path), IB_STATS_BASE_DIR "/%s/device/net", devToRead->devName) >= sizeof(path) ) return 0;
+    if ( (dptr = opendir(path)) ) {
+        struct dirent   *edir;
+        
+        while ( (edir = readdir(dptr)) ) {
+            FILE        *fptr;
+            long        devPort = -1;
+            
+            if ( (strcmp(edir->d_name, ".") == 0) || (strcmp(edir->d_name, "..") == 0) ) continue;
+            if ( strlen(edir->d_name) >= sizeof(devToRead->netDevName) ) continue;
+            if ( ! rc ) {
+                strcpy(devToRead->netDevName, edir->d_name);
+                rc = 1;
+            }
+            if ( snprintf(path, sizeof(path), IB_STATS_BASE_DIR "/%s/device/net/%s/dev_port", devToRead->devName, edir->d_name) < sizeof(path) ) {
+                if ( (fptr = fopen(path, "r")) ) {
+                    if ( fscanf(fptr, "%ld", &devPort) != 1 ) devPort = -1;
+                    fclose(fptr);
+                }
+            }
+            if ( devPort == devToRead->devPort - 1 ) {
+                strcpy(devToRead->netDevName, edir->d_name);
+                break;
+            }
+        }
+        closedir(dptr);
+    }
+    return rc;
+}
+
+/*!
+    @function __IBEthtoolFetchStrings
+    
+    Fetch the names of the statCount ethtool statistics of the named netdev.
+    Like ETHTOOL_GSTATS, the kernel copies out as many names as the driver
+    has at the time of the call, so the buffer carries the same headroom and
+    a changed count is treated as failure.
+    
+    Returns a newly-allocated ethtool_gstrings (to be free()'d by the
+    caller) or NULL on failure.
+ */
+static struct ethtool_gstrings*
+__IBEthtoolFetchStrings(
+    const char              *netDevName,
+    int                     statCount
+)
+{
+    size_t                  stringsSize = sizeof(struct ethtool_gstrings) + (statCount + IB_ETHTOOL_STATS_HEADROOM) * ETH_GSTRING_LEN;
+    struct ethtool_gstrings *ethtoolStrings = (struct ethtool_gstrings*)malloc(stringsSize);
+    
+    if ( ethtoolStrings ) {
+        memset(ethtoolStrings, 0, stringsSize);
+        ethtoolStrings->cmd = ETHTOOL_GSTRINGS;
+        ethtoolStrings->string_set = ETH_SS_STATS;
+        ethtoolStrings->len = statCount;
+        if ( ! __IBEthtoolIoctl(netDevName, ethtoolStrings) || (ethtoolStrings->len != statCount) ) {
+            free((void*)ethtoolStrings);
+            ethtoolStrings = NULL;
+        }
+    }
+    return ethtoolStrings;
+}
+
+/*!
+    @function __IBDevicePortEnsureEthtoolCapacity
+    
+    Make sure the device-port's ethtool statistics buffer can hold statCount
+    values plus IB_ETHTOOL_STATS_HEADROOM, so that a count growing between
+    the check and the ETHTOOL_GSTATS ioctl does not overrun it.
+    
+    Returns non-zero if successful, zero otherwise.
+ */
+static int
+__IBDevicePortEnsureEthtoolCapacity(
+    IBDevicePort            *devToRead,
+    int                     statCount
+)
+{
+    if ( ! devToRead->ethtoolStats || (statCount > devToRead->ethtoolStatCapacity) ) {
+        int                 capacity = statCount + IB_ETHTOOL_STATS_HEADROOM;
+        struct ethtool_stats *ethtoolStats = (struct ethtool_stats*)realloc(devToRead->ethtoolStats, sizeof(struct ethtool_stats) + capacity * sizeof(__u64));
+        
+        if ( ! ethtoolStats ) return 0;
+        devToRead->ethtoolStats = ethtoolStats;
+        devToRead->ethtoolStatCapacity = capacity;
+    }
+    return 1;
+}
+
+/*!
+    @function __IBDevicePortRemapEthtoolStats
+    
+    The driver now reports statCount ethtool statistics, which differs from
+    the count the RoCE fields were mapped against:  re-fetch the statistic
+    names and point each ethtool field at its statistic's new index.  Fields
+    whose statistic has disappeared are marked kIBRoCEMissingStatIdx; the
+    set of fields (and thus registered metrics) does not change.
+    
+    Returns non-zero if successful, zero otherwise.
+ */
+static int
+__IBDevicePortRemapEthtoolStats(
+    IBDevicePort            *devToRead,
+    int                     statCount
+)
+{
+    struct ethtool_gstrings *ethtoolStrings;
+    int                     fieldIdx, statIdx;
+    
+    devToRead->ethtoolStatCount = 0;
+    if ( ! __IBDevicePortEnsureEthtoolCapacity(devToRead, statCount) ) return 0;
+    if ( ! (ethtoolStrings = __IBEthtoolFetchStrings(devToRead->netDevName, statCount)) ) return 0;
+    
+    for ( fieldIdx = 0; fieldIdx < devToRead->roceFieldCount; fieldIdx++ ) {
+        IBRoCEField         *roceField = &devToRead->roceFields[fieldIdx];
+        
+        if ( roceField->ethtoolStatIdx == kIBRoCENetDevStatIdx ) continue;
+        roceField->ethtoolStatIdx = kIBRoCEMissingStatIdx;
+        for ( statIdx = 0; statIdx < statCount; statIdx++ ) {
+            if ( strncmp(roceField->descriptor.subpath, (char*)ethtoolStrings->data + statIdx * ETH_GSTRING_LEN, ETH_GSTRING_LEN) == 0 ) {
+                roceField->ethtoolStatIdx = statIdx;
+                break;
+            }
+        }
+    }
+    free((void*)ethtoolStrings);
+    devToRead->ethtoolStatCount = statCount;
+    debug_msg("[ibcounters] remapped %d ethtool statistics for '%s'", statCount, devToRead->netDevName);
+    return 1;
+}
+
+/*!
+    @function IBDevicePortRoCEInit
+    
+    If the device-port has an Ethernet link layer, map it to its netdev and
+    create the RoCE counter fields:  one for each netdev statistics file,
+    followed by one for each ethtool statistic matching a pattern in
+    IBEthtoolMetricPatterns.  The ethtool statistics buffer is allocated
+    here so that sweeps need not allocate unless the driver's statistic
+    count changes.
+    
+    Device-ports with any other link layer are left untouched.
+    
+    Returns non-zero on failure, zero if successful.
+ */
+static int
+IBDevicePortRoCEInit(
+    IBDevicePort            *devToInit
+)
+{
+    char                    linkLayer[32];
+    struct ethtool_gstrings *ethtoolStrings = NULL;
+    int                     ethtoolStatCount = 0, statIdx, patternIdx;
+    char                    subpath[PATH_MAX];
+    
+    if ( ! __IBDevicePortReadString(devToInit, "link_layer", linkLayer, sizeof(linkLayer)) || (strcmp(linkLayer, "Ethernet") != 0) ) return 0;
+    if ( ! __IBDevicePortFindNetDev(devToInit) ) {
+        debug_msg("[ibcounters] no netdev found for RoCE port %s:%ld", devToInit->devName, devToInit->devPort);
+        return 0;
+    }
+    debug_msg("[ibcounters]      RoCE port mapped to netdev '%s'", devToInit->netDevName);
+    
+    /* Fetch the ethtool statistic names: */
+    if ( IBEthtoolSocket < 0 ) IBEthtoolSocket = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if ( IBEthtoolSocket >= 0 ) ethtoolStatCount = __IBEthtoolStatCount(devToInit->netDevName);
+    if ( ethtoolStatCount > 0 ) {
+        if ( ! (ethtoolStrings = __IBEthtoolFetchStrings(devToInit->netDevName, ethtoolStatCount)) ) ethtoolStatCount = 0;
+    }
+    
+    /* Worst case, every ethtool statistic is selected: */
+    devToInit->roceFields = (IBRoCEField*)malloc((kIBMaxNetDevStatIdx + ethtoolStatCount) * sizeof(IBRoCEField));
+    if ( ! devToInit->roceFields ) goto fail;
+    memset(devToInit->roceFields, 0, (kIBMaxNetDevStatIdx + ethtoolStatCount) * sizeof(IBRoCEField));
+    
+    /* Netdev statistics files, relative to the device-port directory: */
+    for ( statIdx = 0; statIdx < kIBMaxNetDevStatIdx; statIdx++ ) {
+        IBRoCEField         *roceField = &devToInit->roceFields[devToInit->roceFieldCount];
+        
+        snprintf(subpath, sizeof(subpath), "../../device/net/%s/statistics/%s", devToInit->netDevName, IBNetDevMetricDescriptors[statIdx].subpath);
+        roceField->descriptor = IBNetDevMetricDescriptors[statIdx];
+        roceField->descriptor.subpath = strdup(subpath);
+        roceField->descriptor.metricTemplate.name = strdup(IBNetDevMetricDescriptors[statIdx].metricTemplate.name);
+        roceField->ethtoolStatIdx = kIBRoCENetDevStatIdx;
+        devToInit->roceFieldCount++;
+        if ( ! roceField->descriptor.subpath || ! roceField->descriptor.metricTemplate.name ) goto fail;
+    }
+    
+    /* Selected ethtool statistics: */
+    for ( statIdx = 0; statIdx < ethtoolStatCount; statIdx++ ) {
+        char                statName[ETH_GSTRING_LEN + 1];
+        
+        memcpy(statName, (char*)ethtoolStrings->data + statIdx * ETH_GSTRING_LEN, ETH_GSTRING_LEN);
+        statName[ETH_GSTRING_LEN] = '\0';
+        for ( patternIdx = 0; IBEthtoolMetricPatterns[patternIdx].subpath; patternIdx++ ) {
+            if ( fnmatch(IBEthtoolMetricPatterns[patternIdx].subpath, statName, 0) == 0 ) {
+                IBRoCEField *roceField = &devToInit->roceFields[devToInit->roceFieldCount];
+                
+                snprintf(subpath, sizeof(subpath), "%%s_p%%ld_%s", statName);
+                roceField->descriptor = IBEthtoolMetricPatterns[patternIdx];
+                roceField->descriptor.subpath = strdup(statName);
+                roceField->descriptor.metricTemplate.name = strdup(subpath);
+                roceField->ethtoolStatIdx = statIdx;
+                devToInit->roceFieldCount++;
+                if ( ! roceField->descriptor.subpath || ! roceField->descriptor.metricTemplate.name ) goto fail;
+                debug_msg("[ibcounters]      selected ethtool statistic '%s'", statName);
+                break;
+            }
+        }
+    }
+    
+    /* Buffer for the batched ethtool read: */
+    if ( devToInit->roceFieldCount > kIBMaxNetDevStatIdx ) {
+        if ( ! __IBDevicePortEnsureEthtoolCapacity(devToInit, ethtoolStatCount) ) goto fail;
+        devToInit->ethtoolStatCount = ethtoolStatCount;
+    }
+    if ( ethtoolStrings ) free((void*)ethtoolStrings);
+    return 0;
+    
+fail:
+    if ( ethtoolStrings ) free((void*)ethtoolStrings);
+    return 1;
+}
+
+/*!
+    @function IBDevicePortRoCEDestroy
+    
+    Deallocate the RoCE counter fields and ethtool buffer of a device-port.
+ */
+static void
+IBDevicePortRoCEDestroy(
+    IBDevicePort    *devToDestroy
+)
+{
+    if ( devToDestroy->roceFields ) {
+        int         fieldIdx = 0;
+        
+        while ( fieldIdx < devToDestroy->roceFieldCount ) {
+            if ( devToDestroy->roceFields[fieldIdx].descriptor.subpath ) free((void*)devToDestroy->roceFields[fieldIdx].descriptor.subpath);
+            if ( devToDestroy->roceFields[fieldIdx].descriptor.metricTemplate.name ) free((void*)devToDestroy->roceFields[fieldIdx].descriptor.metricTemplate.name);
+            fieldIdx++;
+        }
+        free((void*)devToDestroy->roceFields);
+        devToDestroy->roceFields = NULL;
+    }
+    if ( devToDestroy->ethtoolStats ) {
+        free((void*)devToDestroy->ethtoolStats);
+        devToDestroy->ethtoolStats = NULL;
+    }
+    devToDestroy->roceFieldCount = 0;
+    devToDestroy->ethtoolStatCount = 0;
+    devToDestroy->ethtoolStatCapacity = 0;
+}
+
+/*!
+    @function IBDevicePortReadRoCECounters
+    
+    Attempt to read all RoCE counters associated with a device-port.  The
+    netdev statistics files are refreshed individually like any other
+    counter.  The ethtool statistics are fetched with a single ETHTOOL_GSTATS
+    ioctl whenever any of them is due, and every ethtool field is then
+    updated from that one snapshot.
+    
+    The kernel copies out as many statistics as the driver currently has,
+    regardless of the count we pass, and drivers like mlx5 change that count
+    when channels are reconfigured.  So the count is re-checked before each
+    ioctl and the returned n_stats after it; on any change the read counts
+    as failed and the field-to-statistic mapping is rebuilt.
+ */
+static void
+IBDevicePortReadRoCECounters(
+    IBDevicePort        *devToRead
+)
+{
+    int                 fieldIdx = 0;
+    
+    while ( fieldIdx < devToRead->roceFieldCount ) {
+        if ( devToRead->roceFields[fieldIdx].ethtoolStatIdx == kIBRoCENetDevStatIdx ) {
+            __IBDevicePortRefreshField(devToRead, &devToRead->roceFields[fieldIdx].descriptor, &devToRead->roceFields[fieldIdx].field, IB_STATS_CHECK_FREQUENCY);
+        }
+        fieldIdx++;
+    }
+    
+    if ( devToRead->ethtoolStats ) {
+        struct timeval  currentTime;
+        
+        gettimeofday(&currentTime, NULL);
+        if ( __IBTimeIntervalSince(&currentTime, &devToRead->ethtoolReadTime) >= IB_STATS_CHECK_FREQUENCY ) {
+            int         didRead = 0;
+            int         statCount = __IBEthtoolStatCount(devToRead->netDevName);
+            
+            if ( (statCount > 0) && (statCount != devToRead->ethtoolStatCount) ) {
+                debug_msg("[ibcounters] ethtool statistic count for '%s' changed from %d to %d", devToRead->netDevName, devToRead->ethtoolStatCount, statCount);
+                __IBDevicePortRemapEthtoolStats(devToRead, statCount);
+            }
+            else if ( statCount > 0 ) {
+                devToRead->ethtoolStats->cmd = ETHTOOL_GSTATS;
+                devToRead->ethtoolStats->n_stats = statCount;
+                didRead = __IBEthtoolIoctl(devToRead->netDevName, devToRead->ethtoolStats);
+                if ( didRead && (devToRead->ethtoolStats->n_stats != statCount) ) {
+                    /* Changed under us; remap on the next sweep: */
+                    debug_msg("[ibcounters] ethtool statistic count for '%s' changed during read", devToRead->netDevName);
+                    devToRead->ethtoolStatCount = 0;
+                    didRead = 0;
+                }
+            }
+            debug_msg("[ibcounters] read ethtool statistics for '%s' => %d", devToRead->netDevName, didRead);
+            devToRead->ethtoolReadTime = currentTime;
+            for ( fieldIdx = 0; fieldIdx < devToRead->roceFieldCount; fieldIdx++ ) {
+                IBRoCEField *roceField = &devToRead->roceFields[fieldIdx];
+                
+                if ( roceField->ethtoolStatIdx >= 0 ) {
+                    __IBCounterFieldUpdate(&roceField->field, roceField->descriptor.counterType, didRead, (double)devToRead->ethtoolStats->data[roceField->ethtoolStatIdx], &currentTime);
+                } else if ( roceField->ethtoolStatIdx == kIBRoCEMissingStatIdx ) {
+                    __IBCounterFieldUpdate(&roceField->field, roceField->descriptor.counterType, 0, 0.0, &currentTime);
+                }
+            }
+        }
+    }
+}
+
+/*!
+    @function IBDevicePortMetricCountForPort
+    
+    Returns the number of Ganglia metrics registered for a device-port.
+ */
+static int
+IBDevicePortMetricCountForPort(
+    IBDevicePort        *p
+)
+{
+    return IBDevicePortMetricCount + p->roceFieldCount + IBDerivedMetricsCount + IBSmoothedMetricsCount;
+}
+
+/*!
+    @function IBDevicePortGetField
+    
+    Map a per-port metric index (in registration order) to the device-port's
+    counter field and, optionally, the metric descriptor it was registered
+    from.
+    
+    Returns NULL if fieldIdx is out of range.
+ */
+static IBCounterField*
+IBDevicePortGetField(
+    IBDevicePort        *p,
+    int                 fieldIdx,
+    IBMetricDescriptor  **descriptor
+)
+{
+    IBMetricDescriptor  *d = NULL;
+    IBCounterField      *f = NULL;
+    
+    if ( fieldIdx < 0 ) return NULL;
+    if ( fieldIdx < kIBMaxCounterIdx ) {
+        d = &p->metricDescriptors[fieldIdx];
+        f = &p->fields[fieldIdx];
+    } else if ( (fieldIdx -= kIBMaxCounterIdx) < kIBMaxLinkFieldIdx ) {
+        d = &IBLinkMetricDescriptors[fieldIdx];
+        f = &p->linkFields[fieldIdx];
+    } else if ( (fieldIdx -= kIBMaxLinkFieldIdx) < p->roceFieldCount ) {
+        d = &p->roceFields[fieldIdx].descriptor;
+        f = &p->roceFields[fieldIdx].field;
+    } else if ( (fieldIdx -= p->roceFieldCount) < IBDerivedMetricsCount ) {
+        d = &IBDerivedMetrics[fieldIdx].descriptor;
+        f = &p->derivedFields[fieldIdx];
+    } else if ( (fieldIdx -= IBDerivedMetricsCount) < IBSmoothedMetricsCount ) {
+        d = &IBSmoothedMetrics[fieldIdx].descriptor;
+        f = &p->smoothFields[IBSmoothedMetrics[fieldIdx].counterIdx][IBSmoothedMetrics[fieldIdx].smoothIdx];
+    }
+    if ( descriptor ) *descriptor = d;
+    return f;
+}
+
+/*!
+    @function __IBDerivedMetricEvaluate
+    
+    Run a derived metric's bytecode against the fields of a device-port.
+    The compiler guarantees the code is well-formed and never exceeds
+    IB_DERIVED_MAX_STACK, so the stack lives on the C stack.
+    
+    Returns zero (and leaves result untouched) if any referenced field has
+    no value yet or a division by zero occurs; non-zero otherwise.
+ */
+static int
+__IBDerivedMetricEvaluate(
+    IBDerivedMetric     *metric,
+    IBDevicePort        *p,
+    double              *result
+)
+{
+    double              stack[IB_DERIVED_MAX_STACK];
+    int                 sp = 0, pc = 0;
+    
+    while ( pc < metric->codeLen ) {
+        IBDerivedInstr  *instr = &metric->code[pc++];
+        
+        switch ( instr->opcode ) {
+            case kIBDerivedOpConst:
+                stack[sp++] = metric->consts[instr->operand];
+                break;
+            case kIBDerivedOpLoadValue: {
+                IBCounterField  *field = IBDevicePortGetField(p, instr->operand, NULL);
+                
+                if ( field->fieldState != kIBFieldStateValued ) return 0;
+                stack[sp++] = field->currentValue;
+                break;
+            }
+            case kIBDerivedOpLoadRaw: {
+                IBCounterField  *field = IBDevicePortGetField(p, instr->operand, NULL);
+                
+                if ( field->fieldState == kIBFieldStateUnknown ) return 0;
+                stack[sp++] = field->lastReadValue;
+                break;
+            }
+            case kIBDerivedOpAdd:
+                sp--;
+                stack[sp - 1] += stack[sp];
+                break;
+            case kIBDerivedOpSub:
+                sp--;
+                stack[sp - 1] -= stack[sp];
+                break;
+            case kIBDerivedOpMul:
+                sp--;
+                stack[sp - 1] *= stack[sp];
+                break;
+            case kIBDerivedOpDiv:
+                sp--;
+                if ( stack[sp] == 0.0 ) return 0;
+                stack[sp - 1] /= stack[sp];
+                break;
+            case kIBDerivedOpNeg:
+                stack[sp - 1] = -stack[sp - 1];
+                break;
+        }
+    }
+    *result = stack[0];
+    return 1;
+}
+
+/*!
+    @function IBDevicePortEvaluateDerived
+    
+    Evaluate every derived metric against the current state of a
+    device-port's fields.  A derived field is valued only if its
+    expression could be evaluated; otherwise it falls back to the
+    unknown state.
+ */
+static void
+IBDevicePortEvaluateDerived(
+    IBDevicePort        *devToRead
+)
+{
+    int                 derivedIdx = 0;
+    
+    while ( derivedIdx < IBDerivedMetricsCount ) {
+        IBCounterField  *field = &devToRead->derivedFields[derivedIdx];
+        double          value;
+        
+        if ( __IBDerivedMetricEvaluate(&IBDerivedMetrics[derivedIdx], devToRead, &value) ) {
+            field->currentValue = field->lastReadValue = value;
+            field->fieldState = kIBFieldStateValued;
+        } else {
+            field->fieldState = kIBFieldStateUnknown;
+        }
+        derivedIdx++;
+    }
+}
+
+/*!
+    @function IBDevicePortReadLinkState
+    
+    Refresh the link-state fields associated with a device-port, at most
+    once every IB_STATS_LINK_CHECK_FREQUENCY seconds.
+    
+    If the logical state cannot be read the port is assumed to be active,
+    so that counters are never suspended on account of a missing file.
+    
+    When a port leaves the active state all of its counter fields are
+    returned to the unknown state:  nothing is reported for them while
+    the port is down, and rate-based counters establish a fresh baseline
+    once it comes back up.
+ */
+static void
+IBDevicePortReadLinkState(
+    IBDevicePort        *devToRead
+)
+{
+    int                 wasLinkActive = devToRead->isLinkActive;
+    int                 fieldIdx = 0;
+    
+    while ( fieldIdx < kIBMaxLinkFieldIdx ) {
+        __IBDevicePortRefreshField(devToRead, &IBLinkMetricDescriptors[fieldIdx], &devToRead->linkFields[fieldIdx], IB_STATS_LINK_CHECK_FREQUENCY);
+        fieldIdx++;
+    }
+    
+    if ( devToRead->linkFields[kIBLinkStateFieldIdx].fieldState == kIBFieldStateValued ) {
+        devToRead->isLinkActive = ( (int)devToRead->linkFields[kIBLinkStateFieldIdx].currentValue == kIBPortStateActive );
+    } else {
+        devToRead->isLinkActive = 1;
+    }
+    
+    if ( wasLinkActive && ! devToRead->isLinkActive ) {
+        int             counterIdx = 0;
+        
+        debug_msg("[ibcounters] port %s:%ld is no longer active, suspending counters", devToRead->devName, devToRead->devPort);
+        while ( counterIdx < kIBMaxCounterIdx ) {
+            devToRead->fields[counterIdx].fieldState = kIBFieldStateUnknown;
+            counterIdx++;
+        }
+        counterIdx = 0;
+        while ( counterIdx < kIBMaxCounterIdx ) {
+            if ( devToRead->rateHistory[counterIdx] ) __IBRateHistoryReset(devToRead->rateHistory[counterIdx], devToRead->smoothFields[counterIdx]);
+            counterIdx++;
+        }
+        counterIdx = 0;
+        while ( counterIdx < devToRead->roceFieldCount ) {
+            devToRead->roceFields[counterIdx].field.fieldState = kIBFieldStateUnknown;
+            counterIdx++;
+        }
+        memset(&devToRead->ethtoolReadTime, 0, sizeof(devToRead->ethtoolReadTime));
+    }
+}
+
+/*!
+    @function IBDevicePortReadCounters
+    
+    Attempt to read all counters associated with a device-port.  Each field's
+    state is progressed independently, so failure to read one counter does not
+    prevent the reporting of others.
+    
+    The link state is refreshed first; counters are not read at all on a
+    port that is not active.  When smoothed metrics are enabled, each new
+    sample of a rate-based counter also updates its rate history, and a
+    failed read discards it.  Derived
+    metrics are evaluated last, against the fields as they stand after the
+    reads.
+    
+    On exit, any field associated with devToRead in state kIBFieldStateValued
+    can be reported to gmond.
+    
+    The compile-time constant IB_STATS_CHECK_FREQUENCY determines how often a
+    counter will be rechecked, regardless of the granularity configured in
+    gmond.
+ */
+static void
+IBDevicePortReadCounters(
+    IBDevicePort        *devToRead
+)
+{
+    int                 counterIdx = 0;
+    
+    IBDevicePortReadLinkState(devToRead);
+    if ( devToRead->isLinkActive ) {
+        while ( counterIdx < kIBMaxCounterIdx ) {
+            int     didRead = __IBDevicePortRefreshField(devToRead, &devToRead->metricDescriptors[counterIdx], &devToRead->fields[counterIdx], IB_STATS_CHECK_FREQUENCY);
+            
+            if ( devToRead->rateHistory[counterIdx] ) {
+                if ( didRead ) {
+                    __IBRateHistoryUpdate(devToRead->rateHistory[counterIdx], &devToRead->fields[counterIdx], devToRead->smoothFields[counterIdx]);
+                } else if ( devToRead->fields[counterIdx].fieldState == kIBFieldStateUnknown ) {
+                    /* Failed read:  nothing smoothed is reported until the counter is re-established */
+                    __IBRateHistoryReset(devToRead->rateHistory[counterIdx], devToRead->smoothFields[counterIdx]);
+                }
+            }
+            counterIdx++;
+        }
+        IBDevicePortReadRoCECounters(devToRead);
+    }
+    IBDevicePortEvaluateDerived(devToRead);
+}
+
+/*!
+    @typedef IBDerivedParser
+    
+    State of the recursive-descent compiler for derived-metric expressions.
+    The depth fields track the evaluation stack the emitted code will need;
+    nesting counts the parentheses and unary minuses being parsed, bounding
+    the compiler's own recursion to IB_DERIVED_MAX_CODE levels.
+*/
+typedef struct {
+    const char          *cursor;
+    IBDerivedMetric     *metric;
+    int                 depth;
+    int                 nesting;
+    const char          *error;
+} IBDerivedParser;
+
+/*!
+    @function __IBDerivedParserEmit
+    
+    Append an instruction to the metric being compiled, accounting for its
+    effect on the evaluation stack.
+    
+    Returns non-zero on success, zero (with parser->error set) if the code
+    or stack limits would be exceeded.
+ */
+static int
+__IBDerivedParserEmit(
+    IBDerivedParser     *parser,
+    int                 opcode,
+    int                 operand
+)
+{
+    IBDerivedMetric     *metric = parser->metric;
+    
+    if ( metric->codeLen >= IB_DERIVED_MAX_CODE ) {
+        parser->error = "expression too long";
+        return 0;
+    }
+    switch ( opcode ) {
+        case kIBDerivedOpConst:
+        case kIBDerivedOpLoadValue:
+        case kIBDerivedOpLoadRaw:
+            if ( ++parser->depth > IB_DERIVED_MAX_STACK ) {
+                parser->error = "expression nested too deeply";
+                return 0;
+            }
+            break;
+        case kIBDerivedOpNeg:
+            break;
+        default:
+            parser->depth--;
+            break;
+    }
+    metric->code[metric->codeLen].opcode = opcode;
+    metric->code[metric->codeLen].operand = operand;
+    metric->codeLen++;
+    return 1;
+}
+
+/*!
+    @function __IBDerivedParserSkipSpace
+    
+    Advance the parser past any whitespace and return the next character.
+ */
+static char
+__IBDerivedParserSkipSpace(
+    IBDerivedParser     *parser
+)
+{
+    while ( isspace((unsigned char)*parser->cursor) ) parser->cursor++;
+    return *parser->cursor;
+}
+
+/*!
+    @function __IBMetricShortName
+    
+    Returns the portion of a per-port metric name template that follows the
+    "%s_p%ld_" prefix, e.g. "RxWords".
+ */
+static const char*
+__IBMetricShortName(
+    const char          *metricName
+)
+{
+    /* Skip past the "%ld_" portion of the template: */
+    return strchr(strrchr(metricName, '%'), '_') + 1;
+}
+
+/*!
+    @function __IBDerivedParserName
+    
+    Consume an identifier and resolve it to a per-port field index:  the
+    counter names (e.g. RxWords) followed by the link-state names (e.g.
+    LinkState), as they appear after the <device>_p<port#>_ prefix of the
+    metric names.
+    
+    Returns the field index, or -1 (with parser->error set) if the name
+    is not recognized.
+ */
+static int
+__IBDerivedParserName(
+    IBDerivedParser     *parser
+)
+{
+    const char          *start = parser->cursor;
+    size_t              nameLen;
+    int                 fieldIdx = 0;
+    
+    while ( isalnum((unsigned char)*parser->cursor) || (*parser->cursor == '_') ) parser->cursor++;
+    nameLen = parser->cursor - start;
+    
+    while ( fieldIdx < IBDevicePortMetricCount ) {
+        const char      *metricName = ( fieldIdx < kIBMaxCounterIdx ) ?
+                                        IBMetricDescriptors[kIBDriverMlx4][fieldIdx].metricTemplate.name :
+                                        IBLinkMetricDescriptors[fieldIdx - kIBMaxCounterIdx].metricTemplate.name;
+        const char      *shortName = __IBMetricShortName(metricName);
+        
+        if ( (strlen(shortName) == nameLen) && (strncmp(shortName, start, nameLen) == 0) ) return fieldIdx;
+        fieldIdx++;
+    }
+    parser->error = "unknown counter name";
+    return -1;
+}
+
+static int __IBDerivedParserSum(IBDerivedParser *parser);
+
+/*!
+    @function __IBDerivedParserPrimary
+    
+    primary := number | name | "raw" "(" name ")" | "(" sum ")"
+ */
+static int
+__IBDerivedParserPrimary(
+    IBDerivedParser     *parser
+)
+{
+    char                c = __IBDerivedParserSkipSpace(parser);
+    
+    if ( isdigit((unsigned char)c) || (c == '.') ) {
+        char            *endptr;
+        double          value = strtod(parser->cursor, &endptr);
+        
+        if ( endptr == parser->cursor ) {
+            parser->error = "malformed number";
+            return 0;
+        }
+        if ( parser->metric->constCount >= IB_DERIVED_MAX_CONSTS ) {
+            parser->error = "too many constants";
+            return 0;
+        }
+        parser->cursor = endptr;
+        parser->metric->consts[parser->metric->constCount] = value;
+        return __IBDerivedParserEmit(parser, kIBDerivedOpConst, parser->metric->constCount++);
+    }
+    if ( c == '(' ) {
+        if ( ++parser->nesting > IB_DERIVED_MAX_CODE ) {
+            parser->error = "expression nested too deeply";
+            return 0;
+        }
+        parser->cursor++;
+        if ( ! __IBDerivedParserSum(parser) ) return 0;
+        if ( __IBDerivedParserSkipSpace(parser) != ')' ) {
+            parser->error = "expected ')'";
+            return 0;
+        }
+        parser->cursor++;
+        parser->nesting--;
+        return 1;
+    }
+    if ( isalpha((unsigned char)c) ) {
+        int             fieldIdx;
+        
+        if ( (strncmp(parser->cursor, "raw", 3) == 0) && ! isalnum((unsigned char)parser->cursor[3]) && (parser->cursor[3] != '_') ) {
+            parser->cursor += 3;
+            if ( __IBDerivedParserSkipSpace(parser) != '(' ) {
+                parser->error = "expected '(' after raw";
+                return 0;
+            }
+            parser->cursor++;
+            __IBDerivedParserSkipSpace(parser);
+            if ( (fieldIdx = __IBDerivedParserName(parser)) < 0 ) return 0;
+            if ( __IBDerivedParserSkipSpace(parser) != ')' ) {
+                parser->error = "expected ')'";
+                return 0;
+            }
+            parser->cursor++;
+            return __IBDerivedParserEmit(parser, kIBDerivedOpLoadRaw, fieldIdx);
+        }
+        if ( (fieldIdx = __IBDerivedParserName(parser)) < 0 ) return 0;
+        return __IBDerivedParserEmit(parser, kIBDerivedOpLoadValue, fieldIdx);
+    }
+    parser->error = "expected a number, counter name, or '('";
+    return 0;
+}
+
+/*!
+    @function __IBDerivedParserUnary
+    
+    unary := "-" unary | primary
+ */
+static int
+__IBDerivedParserUnary(
+    IBDerivedParser     *parser
+)
+{
+    if ( __IBDerivedParserSkipSpace(parser) == '-' ) {
+        if ( ++parser->nesting > IB_DERIVED_MAX_CODE ) {
+            parser->error = "expression nested too deeply";
+            return 0;
+        }
+        parser->cursor++;
+        if ( ! __IBDerivedParserUnary(parser) ) return 0;
+        parser->nesting--;
+        return __IBDerivedParserEmit(parser, kIBDerivedOpNeg, 0);
+    }
+    return __IBDerivedParserPrimary(parser);
+}
+
+/*!
+    @function __IBDerivedParserProduct
+    
+    product := unary (("*" | "/") unary)*
+ */
+static int
+__IBDerivedParserProduct(
+    IBDerivedParser     *parser
+)
+{
+    char                c;
+    
+    if ( ! __IBDerivedParserUnary(parser) ) return 0;
+    while ( ((c = __IBDerivedParserSkipSpace(parser)) == '*') || (c == '/') ) {
+        parser->cursor++;
+        if ( ! __IBDerivedParserUnary(parser) ) return 0;
+        if ( ! __IBDerivedParserEmit(parser, (c == '*') ? kIBDerivedOpMul : kIBDerivedOpDiv, 0) ) return 0;
+    }
+    return 1;
+}
+
+/*!
+    @function __IBDerivedParserSum
+    
+    sum := product (("+" | "-") product)*
+ */
+static int
+__IBDerivedParserSum(
+    IBDerivedParser     *parser
+)
+{
+    char                c;
+    
+    if ( ! __IBDerivedParserProduct(parser) ) return 0;
+    while ( ((c = __IBDerivedParserSkipSpace(parser)) == '+') || (c == '-') ) {
+        parser->cursor++;
+        if ( ! __IBDerivedParserProduct(parser) ) return 0;
+        if ( ! __IBDerivedParserEmit(parser, (c == '+') ? kIBDerivedOpAdd : kIBDerivedOpSub, 0) ) return 0;
+    }
+    return 1;
+}
+
+/*!
+    @function IBDerivedMetricCompile
+    
+    Compile expression into the bytecode of metric.
+    
+    Returns NULL on success, otherwise a description of the error.
+ */
+static const char*
+IBDerivedMetricCompile(
+    IBDerivedMetric     *metric,
+    const char          *expression
+)
+{
+    IBDerivedParser     parser = { expression, metric, 0, 0, NULL };
+    
+    metric->codeLen = 0;
+    metric->constCount = 0;
+    if ( __IBDerivedParserSum(&parser) && (__IBDerivedParserSkipSpace(&parser) != '\0') ) {
+        parser.error = "unexpected trailing characters";
+    }
+    return parser.error;
+}
+
+/*!
+    @function __IBDerivedMetricNameIsReserved
+    
+    Returns non-zero if a derived metric called name would be registered
+    under the same <device>_p<port#>_<name> as a built-in metric:  a
+    counter, link-state, RoCE or smoothed rate metric.
+ */
+static int
+__IBDerivedMetricNameIsReserved(
+    const char          *name
+)
+{
+    int                 idx, smoothIdx;
+    
+    for ( idx = 0; idx < kIBMaxCounterIdx; idx++ ) {
+        IBMetricDescriptor  *counter = &IBMetricDescriptors[kIBDriverMlx4][idx];
+        const char          *shortName = __IBMetricShortName(counter->metricTemplate.name);
+        size_t              shortNameLen = strlen(shortName);
+        
+        if ( strcmp(name, shortName) == 0 ) return 1;
+        if ( (counter->counterType == kIBCounterTypeRate) && (strncmp(name, shortName, shortNameLen) == 0) && (name[shortNameLen] == '_') ) {
+            for ( smoothIdx = 0; smoothIdx < kIBMaxSmoothIdx; smoothIdx++ ) {
+                if ( strcmp(name + shortNameLen + 1, IBSmoothKinds[smoothIdx].name) == 0 ) return 1;
+            }
+        }
+    }
+    for ( idx = 0; idx < kIBMaxLinkFieldIdx; idx++ ) {
+        if ( strcmp(name, __IBMetricShortName(IBLinkMetricDescriptors[idx].metricTemplate.name)) == 0 ) return 1;
+    }
+    for ( idx = 0; idx < kIBMaxNetDevStatIdx; idx++ ) {
+        if ( strcmp(name, __IBMetricShortName(IBNetDevMetricDescriptors[idx].metricTemplate.name)) == 0 ) return 1;
+    }
+    for ( idx = 0; IBEthtoolMetricPatterns[idx].subpath; idx++ ) {
+        if ( fnmatch(IBEthtoolMetricPatterns[idx].subpath, name, 0) == 0 ) return 1;
+    }
+    return 0;
+}
+
+/*!
+    @function IBDerivedMetricsInit
+    
+    Compile the derived metrics declared in the module configuration.  Each
+    is a module parameter named derived_<name> whose value is an arithmetic
+    expression over a port's counters, e.g.
+    
+        param derived_RxBytesPerPkt { value = "RxWords*4/RxPkt" }
+    
+    Counter names evaluate to the value reported for the counter (the rate
+    for rate-based counters); raw(<name>) evaluates to the last cumulative
+    value read.  The metric is reported as <device>_p<port#>_<name>.
+    
+    A parameter whose name or expression is invalid, whose name matches a
+    built-in metric, or whose name was already declared is logged and
+    skipped.
+    
+    Returns non-zero on failure, zero if successful.
+ */
+static int
+IBDerivedMetricsInit(
+    apr_pool_t          *pool
+)
+{
+    mmparam             *params;
+    int                 paramIdx, paramCount, derivedIdx;
+    
+    IBDerivedMetrics = NULL;
+    IBDerivedMetricsCount = 0;
+    if ( ! ibcounters_module.module_params_list ) return 0;
+    
+    params = (mmparam*)ibcounters_module.module_params_list->elts;
+    paramCount = ibcounters_module.module_params_list->nelts;
+    IBDerivedMetrics = (IBDerivedMetric*)apr_pcalloc(pool, (paramCount + 1) * sizeof(IBDerivedMetric));
+    if ( ! IBDerivedMetrics ) return 1;
+    
+    for ( paramIdx = 0; paramIdx < paramCount; paramIdx++ ) {
+        IBDerivedMetric *metric = &IBDerivedMetrics[IBDerivedMetricsCount];
+        const char      *name = params[paramIdx].name;
+        const char      *error;
+        
+        if ( strncasecmp(name, IB_DERIVED_PARAM_PREFIX, strlen(IB_DERIVED_PARAM_PREFIX)) != 0 ) continue;
+        name += strlen(IB_DERIVED_PARAM_PREFIX);
+        if ( ! *name || (name[strspn(name, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_")] != '\0') ) {
+            err_msg("[ibcounters] invalid derived metric name '%s'", params[paramIdx].name);
+            continue;
+        }
+        if ( __IBDerivedMetricNameIsReserved(name) ) {
+            err_msg("[ibcounters] derived metric name '%s' conflicts with a built-in metric", params[paramIdx].name);
+            continue;
+        }
+        for ( derivedIdx = 0; derivedIdx < IBDerivedMetricsCount; derivedIdx++ ) {
+            if ( strcmp(name, __IBMetricShortName(IBDerivedMetrics[derivedIdx].descriptor.metricTemplate.name)) == 0 ) break;
+        }
+        if ( derivedIdx < IBDerivedMetricsCount ) {
+            err_msg("[ibcounters] derived metric name '%s' is declared more than once", params[paramIdx].name);
+            continue;
+        }
+        if ( (error = IBDerivedMetricCompile(metric, params[paramIdx].value)) ) {
+            err_msg("[ibcounters] derived metric '%s': %s in '%s'", name, error, params[paramIdx].value);
+            continue;
+        }
+        metric->descriptor.subpath = apr_pstrdup(pool, params[paramIdx].value);
+        metric->descriptor.metricTemplate.name = apr_psprintf(pool, "%%s_p%%ld_%s", name);
+        metric->descriptor.metricTemplate.type = GANGLIA_VALUE_DOUBLE;
+        metric->descriptor.metricTemplate.units = "";
+        metric->descriptor.metricTemplate.slope = "both";
+        metric->descriptor.metricTemplate.fmt = "%.3f";
+        metric->descriptor.metricTemplate.msg_size = UDP_HEADER_SIZE+16;
+        metric->descriptor.metricTemplate.desc = apr_psprintf(pool, "Derived metric: %s", params[paramIdx].value);
+        metric->descriptor.counterType = kIBCounterTypeCount;
+        debug_msg("[ibcounters]  -> derived metric '%s' = %s (%d instructions)", name, params[paramIdx].value, metric->codeLen);
+        IBDerivedMetricsCount++;
+    }
+    return 0;
+}
+
+/*!
+    @function IBSmoothedMetricsInit
+    
+    Enable the smoothed rate metrics selected in the module configuration.
+    The smoothing parameter is a comma- or space-separated list of the kinds
+    to report for every rate-based InfiniBand counter (ewma, 1m, 5m, 15m, or
+    all), and smoothing_ewma_tau optionally overrides the EWMA time constant.
+    The RoCE netdev/ethtool counters are not smoothed:
+    
+        param smoothing { value = "ewma,15m" }
+        param smoothing_ewma_tau { value = "120" }
+    
+    Each is reported as <device>_p<port#>_<counter>_<kind>.
+    
+    Returns non-zero on failure, zero if successful.
+ */
+static int
+IBSmoothedMetricsInit(
+    apr_pool_t          *pool
+)
+{
+    mmparam             *params;
+    int                 paramIdx, counterIdx, smoothIdx;
+    int                 isEnabled[kIBMaxSmoothIdx];
+    
+    IBSmoothedMetrics = NULL;
+    IBSmoothedMetricsCount = 0;
+    IBSmoothEwmaTau = IB_SMOOTH_EWMA_TAU;
+    if ( ! ibcounters_module.module_params_list ) return 0;
+    
+    memset(isEnabled, 0, sizeof(isEnabled));
+    params = (mmparam*)ibcounters_module.module_params_list->elts;
+    for ( paramIdx = 0; paramIdx < ibcounters_module.module_params_list->nelts; paramIdx++ ) {
+        if ( strcasecmp(params[paramIdx].name, "smoothing") == 0 ) {
+            const char  *kinds = params[paramIdx].value;
+            
+            while ( *(kinds += strspn(kinds, ", \t")) ) {
+                size_t  kindLen = strcspn(kinds, ", \t");
+                
+                for ( smoothIdx = 0; smoothIdx < kIBMaxSmoothIdx; smoothIdx++ ) {
+                    if ( ((kindLen == 3) && (strncasecmp(kinds, "all", 3) == 0)) ||
+                         ((kindLen == strlen(IBSmoothKinds[smoothIdx].name)) && (strncasecmp(kinds, IBSmoothKinds[smoothIdx].name, kindLen) == 0)) )
+                    {
+                        isEnabled[smoothIdx] = 1;
+                    }
+                }
+                kinds += kindLen;
+            }
+        }
+        else if ( strcasecmp(params[paramIdx].name, "smoothing_ewma_tau") == 0 ) {
+            double      tau = strtod(params[paramIdx].value, NULL);
+            
+            if ( tau > 0.0 ) {
+                IBSmoothEwmaTau = tau;
+            } else {
+                err_msg("[ibcounters] invalid smoothing_ewma_tau '%s'", params[paramIdx].value);
+            }
+        }
+    }
+    
+    IBSmoothedMetrics = (IBSmoothedMetric*)apr_pcalloc(pool, (kIBMaxCounterIdx * kIBMaxSmoothIdx + 1) * sizeof(IBSmoothedMetric));
+    if ( ! IBSmoothedMetrics ) return 1;
+    
+    for ( counterIdx = 0; counterIdx < kIBMaxCounterIdx; counterIdx++ ) {
+        IBMetricDescriptor  *counter = &IBMetricDescriptors[kIBDriverMlx4][counterIdx];
+        
+        if ( counter->counterType != kIBCounterTypeRate ) continue;
+        for ( smoothIdx = 0; smoothIdx < kIBMaxSmoothIdx; smoothIdx++ ) {
+            IBSmoothedMetric    *metric = &IBSmoothedMetrics[IBSmoothedMetricsCount];
+            
+            if ( ! isEnabled[smoothIdx] ) continue;
+            metric->counterIdx = counterIdx;
+            metric->smoothIdx = smoothIdx;
+            metric->descriptor = *counter;
+            metric->descriptor.metricTemplate.name = apr_psprintf(pool, "%s_%s", counter->metricTemplate.name, IBSmoothKinds[smoothIdx].name);
+            metric->descriptor.metricTemplate.desc = apr_psprintf(pool, "%s, %s", counter->metricTemplate.desc, IBSmoothKinds[smoothIdx].description);
+            debug_msg("[ibcounters]  -> smoothed metric '%s'", metric->descriptor.metricTemplate.name);
+            IBSmoothedMetricsCount++;
+        }
+    }
+    return 0;
+}
+
+/*!
+    @constant IBDevicePortsHead
+    
+    Head of the device-port linked list created by this module.
+*/
+static IBDevicePort *IBDevicePortsHead = NULL;
+
+/*!
+    @constant IBDevicePortsCount
+    
+    The number of device-port elements present in the IBDevicePortsHead linked list.
+*/
+static int          IBDevicePortsCount = 0;
+
+/*!
+    @function IBDevicePortsInit
+    
+    Determine how many IB ports are present and allocate state storage for each.
     
     Devices are found in /sys/class/infiniband, e.g. in subdirectories like mlx5_0/.
     Ports are present in a ports/ subdirectory of the device directory, e.g.
@@ -535,6 +2353,7 @@ IBDevicePortsInit(void)
                             IBDevicePortsCount++;
                             newDevicePort->link = IBDevicePortsHead;
                             IBDevicePortsHead = newDevicePort;
+                            if ( IBDevicePortRoCEInit(newDevicePort) != 0 ) return 1;
                         }
                     }
                     closedir(pdptr);
@@ -562,11 +2381,16 @@ IBDevicePortsDestroy(void)
     while ( p ) {
         IBDevicePort  *next = p->link;
         
+        IBDevicePortRoCEDestroy(p);
         free((void*)p);
         p = next;
     }
     IBDevicePortsHead = NULL;
     IBDevicePortsCount = 0;
+    if ( IBEthtoolSocket >= 0 ) {
+        close(IBEthtoolSocket);
+        IBEthtoolSocket = -1;
+    }
     debug_msg("[ibcounters] exiting IBDevicePortsDestroy()");
 }
 
@@ -605,15 +2429,19 @@ IBDevicePortsRegisterGMetrics(
     apr_pool_create(&ourPool, parentPool);
     
     /* Setup the table of metric descriptors: */
-    gangliaMetricDescriptorArray = apr_array_make(ourPool, (IBDevicePortsCount * kIBMaxCounterIdx) + 1, sizeof(Ganglia_25metric));
+    gangliaMetricDescriptorArray = apr_array_make(ourPool, (IBDevicePortsCount * IBDevicePortMetricCount) + 1, sizeof(Ganglia_25metric));
     debug_msg("[ibcounters]  -> descriptor table created = %p", gangliaMetricDescriptorArray);
     
     while ( p ) {
+        IBMetricDescriptor  *descriptor;
+        int                 portMetricCount = IBDevicePortMetricCountForPort(p);
+        
         counterIdx = 0;
-        while ( counterIdx < kIBMaxCounterIdx ) {
+        while ( counterIdx < portMetricCount ) {
+            IBDevicePortGetField(p, counterIdx, &descriptor);
             newMetric = (Ganglia_25metric*)apr_array_push(gangliaMetricDescriptorArray);
-            *newMetric = p->metricDescriptors[counterIdx].metricTemplate;
-            newMetric->name = apr_psprintf (ourPool, p->metricDescriptors[counterIdx].metricTemplate.name, p->devName, p->devPort);
+            *newMetric = descriptor->metricTemplate;
+            newMetric->name = apr_psprintf (ourPool, descriptor->metricTemplate.name, p->devName, p->devPort);
             debug_msg("[ibcounters]  -> metric allocated '%s' = %p", newMetric->name, newMetric);
             counterIdx++;
         }
@@ -657,6 +2485,476 @@ IBDevicePortsReadCounters(void)
     debug_msg("[ibcounters] exiting IBDevicePortsReadCounters()");
 }
 
+/*!
+    @constant IBErrorWatcherInterval
+    
+    Seconds between error watcher sweeps; zero disables the watcher.
+*/
+static double               IBErrorWatcherInterval = 0.0;
+
+/*!
+    @constant IBErrorWatcherThreshold
+    
+    Increment of an error counter that triggers an alert.
+*/
+static double               IBErrorWatcherThreshold = 1.0;
+
+/*!
+    @constant IBErrorWatcherWindow
+    
+    Seconds over which an error counter's increment is accumulated; also
+    the minimum time between alerts for the same counter.
+*/
+static double               IBErrorWatcherWindow = 10.0;
+
+/*!
+    @constant IBErrorWatcherGMetric
+    
+    Path to the gmetric program used to push alerted counter values, or
+    NULL to only log the alert.
+*/
+static const char           *IBErrorWatcherGMetric = NULL;
+
+/*!
+    @constant IBErrorWatcherPool
+    
+    Pool from which the error watcher thread is created.
+*/
+static apr_pool_t           *IBErrorWatcherPool = NULL;
+
+/*!
+    @constant IBErrorWatcherThread
+    
+    The error watcher thread, if running.
+*/
+static apr_thread_t         *IBErrorWatcherThread = NULL;
+
+/*!
+    @constant IBErrorWatcherShouldStop
+    
+    Set by the main thread to ask the error watcher thread to exit.
+*/
+static volatile int         IBErrorWatcherShouldStop = 0;
+
+/*!
+    @constant IBErrorWatcherChildren
+    
+    Process ids of gmetric processes spawned by the error watcher that
+    have not yet been reaped.
+*/
+static pid_t                IBErrorWatcherChildren[IB_ALERT_MAX_CHILDREN];
+
+/*!
+    @function IBErrorWatcherInit
+    
+    Configure the error watcher from the module configuration.  The watcher
+    is enabled by a non-zero alert_interval (no shorter than
+    IB_ALERT_MIN_INTERVAL) and samples only the count-type (error) counters
+    of each port at that interval, outside the gmond collection cycle:
+    
+        param alert_interval { value = "0.25" }
+        param alert_threshold { value = "10" }
+        param alert_window { value = "10" }
+        param alert_gmetric { value = "/usr/bin/gmetric" }
+    
+    An increment of at least alert_threshold within any alert_window seconds
+    (at least twice alert_interval) writes an event record to the gmond log
+    and, if alert_gmetric is set, pushes the counter's value through gmetric
+    immediately.
+    
+    The thread itself is started by IBErrorWatcherStart().
+    
+    Returns non-zero on failure, zero if successful.
+ */
+static int
+IBErrorWatcherInit(
+    apr_pool_t          *pool
+)
+{
+    mmparam             *params;
+    int                 paramIdx;
+    
+    IBErrorWatcherInterval = 0.0;
+    IBErrorWatcherThreshold = 1.0;
+    IBErrorWatcherWindow = 10.0;
+    IBErrorWatcherGMetric = NULL;
+    IBErrorWatcherPool = pool;
+    if ( ! ibcounters_module.module_params_list ) return 0;
+    
+    params = (mmparam*)ibcounters_module.module_params_list->elts;
+    for ( paramIdx = 0; paramIdx < ibcounters_module.module_params_list->nelts; paramIdx++ ) {
+        if ( strcasecmp(params[paramIdx].name, "alert_interval") == 0 ) {
+            IBErrorWatcherInterval = strtod(params[paramIdx].value, NULL);
+        }
+        else if ( strcasecmp(params[paramIdx].name, "alert_threshold") == 0 ) {
+            IBErrorWatcherThreshold = strtod(params[paramIdx].value, NULL);
+        }
+        else if ( strcasecmp(params[paramIdx].name, "alert_window") == 0 ) {
+            IBErrorWatcherWindow = strtod(params[paramIdx].value, NULL);
+        }
+        else if ( strcasecmp(params[paramIdx].name, "alert_gmetric") == 0 ) {
+            IBErrorWatcherGMetric = apr_pstrdup(pool, params[paramIdx].value);
+        }
+    }
+    if ( IBErrorWatcherInterval < 0.0 ) IBErrorWatcherInterval = 0.0;
+    if ( (IBErrorWatcherInterval > 0.0) && (IBErrorWatcherInterval < IB_ALERT_MIN_INTERVAL) ) {
+        err_msg("[ibcounters] alert_interval %g s is too short, using %g s", IBErrorWatcherInterval, IB_ALERT_MIN_INTERVAL);
+        IBErrorWatcherInterval = IB_ALERT_MIN_INTERVAL;
+    }
+    if ( IBErrorWatcherThreshold < 1.0 ) IBErrorWatcherThreshold = 1.0;
+    if ( IBErrorWatcherWindow < 2.0 * IBErrorWatcherInterval ) IBErrorWatcherWindow = 2.0 * IBErrorWatcherInterval;
+    debug_msg("[ibcounters]  -> error watcher interval %g s, threshold %g, window %g s", IBErrorWatcherInterval, IBErrorWatcherThreshold, IBErrorWatcherWindow);
+    return 0;
+}
+
+/*!
+    @function __IBErrorWatchRead
+    
+    Read a counter value from the start of an already-open sysfs file.
+    
+    Returns non-zero if the counter was read, zero otherwise.
+ */
+static int
+__IBErrorWatchRead(
+    int             fd,
+    double          *value
+)
+{
+    char            buffer[32];
+    char            *endptr;
+    ssize_t         n = pread(fd, buffer, sizeof(buffer) - 1, 0);
+    
+    if ( n <= 0 ) return 0;
+    buffer[n] = '\0';
+    *value = strtod(buffer, &endptr);
+    return ( endptr > buffer );
+}
+
+/*!
+    @function __IBErrorWatcherReapChildren
+    
+    Reap any gmetric processes that have exited.
+ */
+static void
+__IBErrorWatcherReapChildren(void)
+{
+    int             childIdx = 0;
+    
+    while ( childIdx < IB_ALERT_MAX_CHILDREN ) {
+        if ( IBErrorWatcherChildren[childIdx] > 0 ) {
+            int     status;
+            
+            if ( waitpid(IBErrorWatcherChildren[childIdx], &status, WNOHANG) != 0 ) IBErrorWatcherChildren[childIdx] = 0;
+        }
+        childIdx++;
+    }
+}
+
+/*!
+    @function __IBErrorWatcherAlert
+    
+    Record an error burst on the named metric:  log an event record and,
+    if configured, spawn gmetric to push the new value to the cluster
+    without waiting for the gmond collection cycle.  If too many gmetric
+    processes are still outstanding only the event record is written.
+ */
+static void
+__IBErrorWatcherAlert(
+    const char      *metricName,
+    double          value,
+    double          increment,
+    double          elapsed
+)
+{
+    extern char     **environ;
+    
+    err_msg("[ibcounters] ALERT %s increased by %.0f to %.0f within %.3f s", metricName, increment, value, elapsed);
+    if ( IBErrorWatcherGMetric ) {
+        int         childIdx = 0;
+        
+        while ( (childIdx < IB_ALERT_MAX_CHILDREN) && (IBErrorWatcherChildren[childIdx] > 0) ) childIdx++;
+        if ( childIdx < IB_ALERT_MAX_CHILDREN ) {
+            char    valueStr[32];
+            char    *argv[] = { (char*)IBErrorWatcherGMetric, "-n", (char*)metricName, "-v", valueStr, "-t", "double", "-g", "infiniband", NULL };
+            
+            snprintf(valueStr, sizeof(valueStr), "%.0f", value);
+            if ( posix_spawn(&IBErrorWatcherChildren[childIdx], IBErrorWatcherGMetric, NULL, NULL, argv, environ) != 0 ) {
+                err_msg("[ibcounters] unable to spawn '%s'", IBErrorWatcherGMetric);
+                IBErrorWatcherChildren[childIdx] = 0;
+            }
+        } else {
+            debug_msg("[ibcounters] too many outstanding gmetric processes, alert for %s only logged", metricName);
+        }
+    }
+}
+
+/*!
+    @function __IBErrorWatcherOpenCounters
+    
+    Open the sysfs file of every count-type counter of a device-port for
+    the error watcher, each with an empty sample ring.
+ */
+static void
+__IBErrorWatcherOpenCounters(
+    IBDevicePort        *p
+)
+{
+    char                path[PATH_MAX];
+    int                 counterIdx = 0;
+    
+    while ( counterIdx < kIBMaxCounterIdx ) {
+        IBErrorWatchField   *watch = &p->errorWatch[counterIdx];
+        
+        watch->sampleCount = 0;
+        if ( (watch->fd < 0) && (p->metricDescriptors[counterIdx].counterType == kIBCounterTypeCount) ) {
+            if ( snprintf(path, sizeof(path), IB_STATS_BASE_DIR "/%s/ports/%ld/%s", p->devName, p->devPort, p->metricDescriptors[counterIdx].subpath) < sizeof(path) ) {
+                watch->fd = open(path, O_RDONLY | O_CLOEXEC);
+                debug_msg("[ibcounters]  -> watching '%s' = %d", path, watch->fd);
+            }
+        }
+        counterIdx++;
+    }
+}
+
+/*!
+    @function __IBErrorWatcherCloseCounters
+    
+    Close the counter files the error watcher holds open for a device-port
+    and discard their samples.
+ */
+static void
+__IBErrorWatcherCloseCounters(
+    IBDevicePort        *p
+)
+{
+    int                 counterIdx = 0;
+    
+    while ( counterIdx < kIBMaxCounterIdx ) {
+        if ( p->errorWatch[counterIdx].fd >= 0 ) close(p->errorWatch[counterIdx].fd);
+        p->errorWatch[counterIdx].fd = -1;
+        p->errorWatch[counterIdx].sampleCount = 0;
+        counterIdx++;
+    }
+}
+
+/*!
+    @function __IBErrorWatcherCheckLinkState
+    
+    Re-read the logical link state of a device-port, at most once every
+    IB_STATS_LINK_CHECK_FREQUENCY seconds, and open or close its watched
+    counters as the port enters or leaves the active state.  As in
+    IBDevicePortReadLinkState(), a state that cannot be read counts as
+    active.
+ */
+static void
+__IBErrorWatcherCheckLinkState(
+    IBDevicePort        *p,
+    double              now
+)
+{
+    double              state;
+    int                 isLinkActive;
+    
+    if ( (p->errorWatchStateTime > 0.0) && (now - p->errorWatchStateTime < IB_STATS_LINK_CHECK_FREQUENCY) ) return;
+    p->errorWatchStateTime = now;
+    
+    isLinkActive = ! ( (p->errorWatchStateFd >= 0) && __IBErrorWatchRead(p->errorWatchStateFd, &state) && ((int)state != kIBPortStateActive) );
+    if ( isLinkActive && ! p->errorWatchLinkActive ) {
+        debug_msg("[ibcounters] port %s:%ld is active, watching error counters", p->devName, p->devPort);
+        __IBErrorWatcherOpenCounters(p);
+    }
+    else if ( ! isLinkActive && p->errorWatchLinkActive ) {
+        debug_msg("[ibcounters] port %s:%ld is no longer active, not watching error counters", p->devName, p->devPort);
+        __IBErrorWatcherCloseCounters(p);
+    }
+    p->errorWatchLinkActive = isLinkActive;
+}
+
+/*!
+    @function IBErrorWatcherSweep
+    
+    Read each watched error counter once and raise an alert for any whose
+    increment over the oldest sample still within the last
+    IBErrorWatcherWindow seconds has reached IBErrorWatcherThreshold, so a
+    burst is caught wherever it falls relative to earlier sweeps.  At most
+    one alert per counter is raised per window, and the samples are
+    discarded after an alert so the same burst is not reported twice.  A
+    counter that cannot be read or goes backwards simply drops its samples.
+    Ports whose link is not active are skipped.
+ */
+static void
+IBErrorWatcherSweep(void)
+{
+    IBDevicePort        *p = IBDevicePortsHead;
+    struct timeval      currentTime;
+    double              now;
+    
+    gettimeofday(&currentTime, NULL);
+    now = (double)currentTime.tv_sec + 1.0e-6 * (double)currentTime.tv_usec;
+    
+    while ( p ) {
+        int             counterIdx = 0;
+        
+        __IBErrorWatcherCheckLinkState(p, now);
+        while ( p->errorWatchLinkActive && (counterIdx < kIBMaxCounterIdx) ) {
+            IBErrorWatchField   *watch = &p->errorWatch[counterIdx];
+            double              value;
+            
+            if ( watch->fd < 0 ) {
+                counterIdx++;
+                continue;
+            }
+            if ( ! __IBErrorWatchRead(watch->fd, &value) ) {
+                watch->sampleCount = 0;
+                counterIdx++;
+                continue;
+            }
+            if ( watch->sampleCount && (value < watch->samples[watch->sampleHead].value) ) watch->sampleCount = 0;
+            
+            /* Drop samples that have aged out of the window: */
+            while ( watch->sampleCount ) {
+                int     oldestIdx = (watch->sampleHead + IB_ALERT_SAMPLE_COUNT - (watch->sampleCount - 1)) % IB_ALERT_SAMPLE_COUNT;
+                
+                if ( now - watch->samples[oldestIdx].time <= IBErrorWatcherWindow ) {
+                    double          increment = value - watch->samples[oldestIdx].value;
+                    
+                    if ( (increment >= IBErrorWatcherThreshold) && (now - watch->lastAlertTime >= IBErrorWatcherWindow) ) {
+                        char        metricName[PATH_MAX];
+                        
+                        snprintf(metricName, sizeof(metricName), p->metricDescriptors[counterIdx].metricTemplate.name, p->devName, p->devPort);
+                        __IBErrorWatcherAlert(metricName, value, increment, now - watch->samples[oldestIdx].time);
+                        watch->lastAlertTime = now;
+                        watch->sampleCount = 0;
+                    }
+                    break;
+                }
+                watch->sampleCount--;
+            }
+            
+            /* Retain the new sample if the newest one is old enough: */
+            if ( (watch->sampleCount == 0) || (now - watch->samples[watch->sampleHead].time >= IBErrorWatcherWindow / (IB_ALERT_SAMPLE_COUNT - 1)) ) {
+                watch->sampleHead = (watch->sampleHead + 1) % IB_ALERT_SAMPLE_COUNT;
+                watch->samples[watch->sampleHead].time = now;
+                watch->samples[watch->sampleHead].value = value;
+                if ( watch->sampleCount < IB_ALERT_SAMPLE_COUNT ) watch->sampleCount++;
+            }
+            counterIdx++;
+        }
+        p = p->link;
+    }
+    __IBErrorWatcherReapChildren();
+}
+
+/*!
+    @function IBErrorWatcherMain
+    
+    Body of the error watcher thread:  sweep every IBErrorWatcherInterval
+    seconds until asked to stop.
+ */
+static void* APR_THREAD_FUNC
+IBErrorWatcherMain(
+    apr_thread_t    *thread,
+    void            *context
+)
+{
+    while ( ! IBErrorWatcherShouldStop ) {
+        IBErrorWatcherSweep();
+        apr_sleep((apr_interval_time_t)(IBErrorWatcherInterval * 1.0e6));
+    }
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+/*!
+    @function __IBErrorWatcherCloseFiles
+    
+    Close the counter and link-state files held open for the error watcher.
+ */
+static void
+__IBErrorWatcherCloseFiles(void)
+{
+    IBDevicePort        *p = IBDevicePortsHead;
+    
+    while ( p ) {
+        __IBErrorWatcherCloseCounters(p);
+        if ( p->errorWatchStateFd >= 0 ) close(p->errorWatchStateFd);
+        p->errorWatchStateFd = -1;
+        p->errorWatchLinkActive = 0;
+        p = p->link;
+    }
+}
+
+/*!
+    @function IBErrorWatcherStart
+    
+    If the error watcher is enabled and not yet running, open the link-state
+    file of every device-port and start the watcher thread, which opens the
+    count-type counter files of a port only while its link is active.  Called from the metric handler so that the thread is created
+    in the process that actually runs the collection cycle.
+    
+    If the thread cannot be created the watcher is disabled.
+ */
+static void
+IBErrorWatcherStart(void)
+{
+    IBDevicePort        *p = IBDevicePortsHead;
+    char                path[PATH_MAX];
+    
+    if ( (IBErrorWatcherInterval <= 0.0) || IBErrorWatcherThread ) return;
+    
+    debug_msg("[ibcounters] entered IBErrorWatcherStart()");
+    while ( p ) {
+        int             counterIdx = 0;
+        
+        while ( counterIdx < kIBMaxCounterIdx ) {
+            memset(&p->errorWatch[counterIdx], 0, sizeof(p->errorWatch[counterIdx]));
+            p->errorWatch[counterIdx].fd = -1;
+            counterIdx++;
+        }
+        p->errorWatchStateFd = -1;
+        p->errorWatchLinkActive = 0;
+        p->errorWatchStateTime = 0.0;
+        if ( snprintf(path, sizeof(path), IB_STATS_BASE_DIR "/%s/ports/%ld/%s", p->devName, p->devPort, IBLinkMetricDescriptors[kIBLinkStateFieldIdx].subpath) < sizeof(path) ) {
+            p->errorWatchStateFd = open(path, O_RDONLY | O_CLOEXEC);
+            debug_msg("[ibcounters]  -> watching link state '%s' = %d", path, p->errorWatchStateFd);
+        }
+        p = p->link;
+    }
+    
+    memset(IBErrorWatcherChildren, 0, sizeof(IBErrorWatcherChildren));
+    IBErrorWatcherShouldStop = 0;
+    if ( apr_thread_create(&IBErrorWatcherThread, NULL, IBErrorWatcherMain, NULL, IBErrorWatcherPool) != APR_SUCCESS ) {
+        err_msg("[ibcounters] unable to start error watcher thread");
+        __IBErrorWatcherCloseFiles();
+        IBErrorWatcherThread = NULL;
+        IBErrorWatcherInterval = 0.0;
+    }
+    debug_msg("[ibcounters] exiting IBErrorWatcherStart()");
+}
+
+/*!
+    @function IBErrorWatcherStop
+    
+    Stop the error watcher thread, if running, and close the files it held
+    open.
+ */
+static void
+IBErrorWatcherStop(void)
+{
+    apr_status_t        threadStatus;
+    
+    if ( ! IBErrorWatcherThread ) return;
+    
+    debug_msg("[ibcounters] entered IBErrorWatcherStop()");
+    IBErrorWatcherShouldStop = 1;
+    apr_thread_join(&threadStatus, IBErrorWatcherThread);
+    IBErrorWatcherThread = NULL;
+    
+    __IBErrorWatcherCloseFiles();
+    __IBErrorWatcherReapChildren();
+    debug_msg("[ibcounters] exiting IBErrorWatcherStop()");
+}
+
 /*!
     @function ibcounters_metric_init
     
@@ -681,6 +2979,15 @@ ibcounters_metric_init (
 
     debug_msg("[ibcounters] entered ibcounters_metric_init()");
 
+    /* Compile any derived metrics from the configuration: */
+    if ( IBDerivedMetricsInit(p) != 0 ) return 1;
+
+    /* Enable any smoothed rates from the configuration: */
+    if ( IBSmoothedMetricsInit(p) != 0 ) return 1;
+
+    /* Configure the error watcher: */
+    if ( IBErrorWatcherInit(p) != 0 ) return 1;
+
     /* See if we have any Infiniband devices present: */
     if ( IBDevicePortsInit() != 0 ) return 1;
 
@@ -707,6 +3014,9 @@ ibcounters_metric_cleanup(void)
 {
     debug_msg("[ibcounters] entered ibcounters_metric_cleanup()");
     
+    /* Stop the error watcher before the device-ports go away: */
+    IBErrorWatcherStop();
+    
     /* Destroy the device stats list: */
     IBDevicePortsDestroy();
     
@@ -727,17 +3037,20 @@ ibcounters_metric_handler(
 {
     g_val_t         result;
     IBDevicePort    *p = IBDevicePortsHead;
+    IBCounterField  *field = NULL;
     int             modIdx = metricIdx;
     
     debug_msg("[ibcounters] entered ibcounters_metric_handler(%d)", metricIdx);
+    IBErrorWatcherStart();
     IBDevicePortsReadCounters();
     
-    while ( p && (modIdx >= kIBMaxCounterIdx) ) {
+    while ( p && (modIdx >= IBDevicePortMetricCountForPort(p)) ) {
+        modIdx -= IBDevicePortMetricCountForPort(p);
         p = p->link;
-        modIdx -= kIBMaxCounterIdx;
     }
-    if ( p && (p->fields[modIdx].fieldState == kIBFieldStateValued) ) {
-        result.d = p->fields[modIdx].currentValue;
+    if ( p ) field = IBDevicePortGetField(p, modIdx, NULL);
+    if ( field && (field->fieldState == kIBFieldStateValued) ) {
+        result.d = field->currentValue;
         debug_msg("[ibcounters]  REPORTED %s -> %g", ibcounters_module.metrics_info[metricIdx].name, result.d);
     } else {
         result.d = 0;